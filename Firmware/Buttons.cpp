@@ -7,6 +7,7 @@ volatile int buttonPressId = 0;
 const int BLINK_PERIOD = 0x100;
 const int BLINK_DUTY_CYCLE = 0x40;
 const int BLINK_PRESCALER = 0x6000;
+const unsigned int buttonLongPress = 2000;			// ticks held to re-zero instead of calibrating
 
 void stopIdTimer();
 void stopCalibTimer();
@@ -48,6 +49,18 @@ void EXTI2_3_IRQHandler(void) {
 	}		
 }
 
+// called after a CALIB press: true once the button has been held for buttonLongPress ticks
+bool buttonCalibLongPress()
+{
+	unsigned int start = gTickCount;
+	
+	while (GPIOA->IDR & GPIO_IDR_3)
+	{
+		if (gTickCount - start > buttonLongPress) return true;
+	}
+	return false;
+}
+
 void stopIdTimer()
 {
 	TIM3->CR1 &= ~TIM_CR1_CEN;							// disable timer 3
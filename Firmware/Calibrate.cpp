@@ -1,248 +1,607 @@
 #include <main.h>
 
-extern const int maxPoles;
+const int maxPoles = 32;								// pole pairs calibration accepts
 
 const int calibPower = sin_range/2;
-const int quadrantDiv = SENSOR_MAX / numQuadrants;
-	
+const int calibShift = 15 - calibTableBits;				// sensor counts per table entry = 1 << calibShift
+const int calibBinMask = calibTableSize - 1;
+const int calibDetectDistance = SENSOR_MAX / 16;		// sensor travel used to detect the direction
+const int calibSettleBins = 2;							// boundaries passed before recording, takes up the lag
+const int calibDetectStep = 64;							// field step while detecting the direction
+const int calibMinStep = 4;								// field step next to a bin boundary
+const int calibMaxStep = sin_period / 16;				// largest field step the rotor follows reliably
+const int calibSettleNoise = 2;							// sensor counts between readings that count as at rest
+const int calibSettleTicks = 20;						// give up waiting for rest after this many ticks
+const unsigned int calibBudget = 60000;					// hard limit on the whole calibration, ticks
+const int calibCorrectionBits = 6;
+const int calibCorrectionSize = 1 << calibCorrectionBits;	// sensor error correction points per revolution
+const int calibCorrectionShift = 15 - calibCorrectionBits;
+static_assert(SENSOR_MAX == 1 << 15, "calibration table indexes a 15 bit sensor angle");
+static_assert(maxPoles << calibShift < sin_period / 2, "per-bin electric travel must not wrap");
+
 ConfigData* config = (ConfigData*)flashPageAddress;
 
-int currentPole = 0;
+unsigned int calibStart;
+int hysteresisSum;
+CalibrationReport calibReport;							// last calibrate() run, lost on reset
+int16_t calibCorrection[calibCorrectionSize + 1];		// sensor counts to add, last entry repeats the first
+int16_t activeHarmonics[calibHarmonics][2];				// in use, start from flash and refined while running
+
+const int refineBinBits = 5;
+const int refineBins = 1 << refineBinBits;				// boundaries timed per revolution
+const int refineBinShift = 15 - refineBinBits;
+const int refineMaxTorque = sin_range / 4;				// light load: the error is in the sensor, not in a lagging rotor
+const int refineMinPeriod = refineBins * 8;				// control periods per revolution, faster is timed too coarsely
+const int refineRevolutions = 16;						// averaged per update, makes refineSum Q4
+const int refineSaveMinGain = 32;						// residual drop over the flash set, Q4 sensor counts summed, before saving
+const int refineSaveMargin = 2;							// ... and by at least 1 / (1 << refineSaveMargin) of it
+const unsigned int refineSaveInterval = 600000;			// ticks between saves, the page takes about 10k erases
+const int refineMaxSaves = 8;							// per power up
+
+// sign extend a 15 bit electric angle difference
+
+static inline int wrapElectric(int d) {
+	return (d << 17) >> 17;
+}
 
-int getElectricDegrees() {
-	int angle = spiCurrentAngle % sin_period;
-	if (angle < 0) angle += sin_period;
-	
-	int a;
-	int q = angle / quadrantDiv;
-	int range = config->quadrants[q].range;
-	int qstart;
-	
-	if (config->up)
+static inline int calibLookup(const int16_t* table, int angle) {
+	angle &= sin_mask;
+	int i = angle >> calibShift;
+	int e0 = table[i];
+	int e1 = table[(i + 1) & calibBinMask];
+
+	return e0 + (wrapElectric(e1 - e0) * (angle & ((1 << calibShift) - 1)) >> calibShift);
+}
+
+int getElectricDegrees(int angle) {
+	return calibLookup(config->calib.table, angle);
+}
+
+// sensor error correction, interpolated from the table built out of the fitted harmonics
+
+static inline int sensorCorrection(int angle) {
+	angle &= sin_mask;
+	int i = angle >> calibCorrectionShift;
+	int c0 = calibCorrection[i];
+
+	return c0 + ((calibCorrection[i + 1] - c0) * (angle & ((1 << calibCorrectionShift) - 1)) >> calibCorrectionShift);
+}
+
+int correctSensor(int angle) {
+	return (angle + sensorCorrection(angle)) & sin_mask;
+}
+
+static void buildCorrection() {
+	for (int i = 0; i <= calibCorrectionSize; i++)
 	{
-		int min = config->quadrants[q].minAngle;
-		qstart = q * quadrantDiv;
-		a = min + (angle - qstart) * range / quadrantDiv;
+		int sum = 0;
+		for (int h = 0; h < calibHarmonics; h++)
+		{
+			int phase = (h + 1) * i << calibCorrectionShift;
+			sum += activeHarmonics[h][0] * isin_table(phase + sin_period / 4) +
+				   activeHarmonics[h][1] * isin_table(phase);
+		}
+		calibCorrection[i] = (sum + (1 << 15)) >> 16;		// Q4 * Q12 -> sensor counts, one store per entry
 	}
-	else
+}
+
+static void setHarmonics(const CalibrationData* c) {
+	for (int h = 0; h < calibHarmonics; h++)
 	{
-		int max = config->quadrants[q].maxAngle;
-		qstart = q * quadrantDiv;
-		a = max - (angle - qstart) * range / quadrantDiv;
+		activeHarmonics[h][0] = c->calibrated ? c->harmonics[h][0] : 0;
+		activeHarmonics[h][1] = c->calibrated ? c->harmonics[h][1] : 0;
 	}
-	
-	return a;
+	buildCorrection();
 }
 
-void calibrate() {
-	const int step = 5;
-	int a = 0;
-	int i = 0;
-	int sensor;
-	int prevSensor;
-	
-	bool up;
-	int q = 0;
-	int prevQ = -1;
-	int firstQ = -1;
-	int quadrantsLeft = numQuadrants;
-	
-	QuadrantData qUp[numQuadrants] = { 0 };
-	QuadrantData qDn[numQuadrants] = { 0 };
-	
-	for (i = 0; i < numQuadrants; i++)
+void initCalibration() {
+	setHarmonics(&config->calib);
+	coggingActive = config->calib.calibrated && config->calib.cogCompensation == 1;
+}
+
+// cogging -------------------------------------------------------------------
+//
+// Cogging repeats LCM(slots, poles) times per revolution, a whole number of times per
+// electric revolution, so the table covers one electric revolution and every pole pair
+// shares it. identifyCogging() holds the rotor at one point per table entry across one
+// pole pair with a PID on the torque command, while the control loop keeps commutating,
+// and records the mean command that holds it there. A forward and a backward pass are
+// averaged so friction cancels. setPwmTorque() adds the interpolated holding torque.
+// Each point settles only as long as it needs to, and the whole run is held to cogBudget;
+// the bus is not served meanwhile.
+
+const int cogBinShift = 15 - cogBinBits;
+const int cogSettleTicks = 300;							// most per point before averaging anyway
+const int cogSettleMin = 10;							// settled once this many ticks in a row are
+const int cogSettleError = 8;							// within this many sensor counts of the point
+const int cogAverageBits = 6;
+const int cogAverageTicks = 1 << cogAverageBits;		// averaged after settling
+const unsigned int cogBudget = 45000;					// hard limit on the whole identification, ticks
+const int cogKp = 48;									// torque per sensor count, above the steepest cogging
+const int cogKi = 4;									// torque per sensor count per tick, Q4
+const int cogKdShift = 6;								// damping, observerVelocity >> n
+const int cogMaxTorque = sin_range / 2;
+
+bool coggingActive = false;
+int cogIntegral;										// carried from point to point, the cogging is continuous
+
+int cogFeedForward(int electricAngle) {
+	electricAngle &= sin_mask;
+	int i = electricAngle >> cogBinShift;
+	int c0 = config->calib.cogging[i];
+	int c1 = config->calib.cogging[(i + 1) & (cogBins - 1)];
+
+	return (c0 * cogUnit) + ((c1 - c0) * cogUnit * (electricAngle & ((1 << cogBinShift) - 1)) >> cogBinShift);
+}
+
+static int cogHold(int target) {
+	int sign = config->calib.up ? 1 : -1;				// positive torque turns the sensor up
+	int sum = 0;
+	int inside = 0;
+	int averaged = 0;
+
+	for (int t = 0; averaged < cogAverageTicks; t++)
 	{
-		qUp[i].minAngle = 0xFFFFFF;
-		qDn[i].minAngle = 0xFFFFFF;
+		delay(1);
+		int error = wrapElectric(target - spiCurrentAngle);
+		cogIntegral += error * cogKi;
+		if (cogIntegral > cogMaxTorque << 4) cogIntegral = cogMaxTorque << 4;
+		if (cogIntegral < -(cogMaxTorque << 4)) cogIntegral = -(cogMaxTorque << 4);
+
+		int torque = error * cogKp + (cogIntegral >> 4) - (observerVelocity >> cogKdShift);
+		if (torque > cogMaxTorque) torque = cogMaxTorque;
+		if (torque < -cogMaxTorque) torque = -cogMaxTorque;
+		usartTorqueCommandValue = torque * sign;
+
+		if (inside < cogSettleMin && t < cogSettleTicks)		// still settling
+		{
+			inside = (error <= cogSettleError && error >= -cogSettleError) ? inside + 1 : 0;
+			continue;
+		}
+		sum += torque * sign;
+		averaged++;
 	}
 
-	// gently set 0 angle
-	
-	for (int p = 0; p < calibPower / 10; p++)
+	return sum >> cogAverageBits;
+}
+
+bool identifyCogging() {
+#ifndef CONTROL_IN_TIMER
+	return false;										// cogHold() needs the loop commutating behind it
+#endif
+	if (!config->calib.calibrated) return false;
+
+	coggingActive = false;								// measure the bare motor
+	cogIntegral = 0;
+
+	ConfigData lc;
+	memcpy(&lc, config, sizeof(ConfigData));
+
+	// one point before the start and one past the end, so every recorded point is approached
+	// in the direction of its pass
+
+	int16_t sum[cogBins] = { 0 };
+	uint8_t count[cogBins] = { 0 };
+	int start = spiCurrentAngle;
+	int span = sin_period / config->calib.polePairs;		// sensor counts per electric revolution
+	unsigned int cogStart = gTickCount;
+
+	cogHold(start - span / cogBins);
+	for (int pass = 0; pass < 2; pass++)
 	{
-		delay(1);
-		setPwm(0, p * 10);
+		for (int k = 0; k <= cogBins; k++)
+		{
+			int point = pass == 0 ? k : cogBins - 1 - k;
+			if (point < 0) break;
+
+			if (gTickCount - cogStart > cogBudget)
+			{
+				usartTorqueCommandValue = 0;					// out of time, keep the previous table
+				coggingActive = config->calib.cogCompensation == 1;
+				return false;
+			}
+
+			int target = (start + point * span / cogBins) & sin_mask;
+			int torque = cogHold(target);
+			if (point == cogBins) continue;
+
+			int bin = ((getElectricDegrees(target) + (1 << (cogBinShift - 1))) >> cogBinShift) & (cogBins - 1);
+			sum[bin] += torque;
+			count[bin]++;
+		}
 	}
-	
-	// find the edge of the quadrant, detect direction
-	
-	int sensorFirst = spiReadAngle();
-	int q1 = -1;
-	int q2 = -1;
-	int q3 = -1;
-	while (true)
+
+	usartTorqueCommandValue = 0;
+
+	// a nonlinear table can leave a bin without a point, it takes its neighbours' mean
+
+	for (int b = 0; b < cogBins; b++)
 	{
-		sensor = spiReadAngle();
-		prevSensor = sensor;
-		q = sensor / quadrantDiv;
-			
-		if (q1 == -1) q1 = q;
-		else if (q2 == -1 && q1 != q) q2 = q;
-		else if (q3 == -1 && q1 != q && q2 != q) q3 = q;
-		else if (q1 != q && q2 != q && q3 != q) break;
-		
-		a += step;
-		delay(1);
-		setPwm(a, calibPower);		
+		int torque = count[b] ? sum[b] / count[b] : 0;
+		if (!count[b])
+		{
+			int prev = (b - 1) & (cogBins - 1);
+			int next = (b + 1) & (cogBins - 1);
+			if (count[prev] && count[next]) torque = (sum[prev] / count[prev] + sum[next] / count[next]) / 2;
+		}
+
+		torque = (torque + (torque < 0 ? -cogUnit / 2 : cogUnit / 2)) / cogUnit;
+		lc.calib.cogging[b] = torque > 127 ? 127 : (torque < -127 ? -127 : torque);
+	}
+
+	lc.calib.cogCompensation = 1;
+	writeFlash((uint16_t*)&lc, sizeof(ConfigData) / sizeof(uint16_t));	// pauses the loop itself
+
+	coggingActive = true;
+	return true;
+}
+
+// background refinement -----------------------------------------------------
+//
+// While the motor turns at a steady speed under light load, the control loop times the
+// crossings of refineBins coarse boundaries over one revolution. Uniform motion puts the
+// rotor at t / period of the revolution at time t; the difference to the boundary the
+// sensor reported is what remains of the sensor error. The main loop averages that over
+// refineRevolutions revolutions and moves the harmonics half way towards cancelling it.
+// A set only goes to flash once its measured residual beats the one measured for the flash
+// set by a margin, and no more often than refineSaveInterval. Load that varies over the
+// revolution looks like sensor error to this, which is why it is opt-in with CALIB_REFINE.
+// The electric table is indexed by the corrected angle and is left as it is: a shifted
+// magnet moves the sensor, not the windings.
+
+volatile bool refineReady = false;						// a revolution is waiting for calibRefine()
+int refineBin = -1;
+int refineDir;
+int refineFirst;										// boundary the revolution started on
+int refineCount = 0;									// boundaries crossed so far
+unsigned int refineStart;
+unsigned int refinePeriod;
+uint16_t refineTimes[refineBins];						// control periods from the first boundary
+unsigned int refinePrevPeriod = 0;
+int refineSum[refineBins];								// sensor error summed over the revolutions
+int refineRevs = 0;
+bool refineSavePending = false;
+int16_t refineSaveHarmonics[calibHarmonics][2];			// set whose residual earned the save
+int refineFlashResidual = -1;							// measured for the set in flash, -1 = not yet
+unsigned int refineLastSave = 0;
+int refineSaves = 0;
+
+static void refineReset() {
+	refineReady = false;
+	refineSavePending = false;
+	refineFlashResidual = -1;							// flash changed, next batch measures it again
+	refineCount = 0;
+	refineRevs = 0;
+	refinePrevPeriod = 0;
+	for (int b = 0; b < refineBins; b++) refineSum[b] = 0;
+}
+
+void calibRefineSample(int angle) {
+	int bin = angle >> refineBinShift;
+	if (bin == refineBin) return;
+
+	int step = (bin - refineBin) & (refineBins - 1);
+	int dir = step == 1 ? 1 : (step == refineBins - 1 ? -1 : 0);
+	if (refineCount > 0 && dir == -refineDir) return;			// noise on the boundary just crossed
+
+	int boundary = (dir > 0 ? bin : refineBin) & (refineBins - 1);
+	int torque = usartTorqueCommandValue;
+	unsigned int now = controlCycles;
+	refineBin = bin;
+
+	if (dir == 0 || refineReady || torque >= refineMaxTorque || torque <= -refineMaxTorque ||
+		(refineCount > 0 && now - refineStart > 0xFFFF))
+	{
+		refineCount = 0;										// start over on the next boundary
+		return;
 	}
-	
-	if (sensor > sensorFirst)
+
+	if (refineCount == 0)
 	{
-		if (sensor - sensorFirst < sensorFirst + (SENSOR_MAX - sensor))
-			up = true;
-		else
-			up = false;
+		refineDir = dir;
+		refineFirst = boundary;
+		refineStart = now;
 	}
-	else
+	else if (refineCount == refineBins)
 	{
-		if (sensorFirst - sensor < sensor + (SENSOR_MAX - sensorFirst))
-			up = false;
-		else
-			up = true;
+		refinePeriod = now - refineStart;						// back on the first boundary
+		refineCount = 0;
+		refineReady = true;
+		return;
 	}
 
-	// full turn forward
+	refineTimes[boundary] = now - refineStart;
+	refineCount++;
+}
 
-	bool awayFromFirst = false;
-	bool backToFirst = false;
-	prevQ = q;
-	while (true)
+void calibRefine() {
+	if (refineSavePending && usartTorqueCommandValue == 0)
 	{
-		sensor = spiReadAngle();
-		q = sensor / quadrantDiv;
-		if (q != prevQ)
+		ConfigData lc;
+		memcpy(&lc, config, sizeof(ConfigData));
+		for (int h = 0; h < calibHarmonics; h++)
 		{
-			q1 = q;
+			lc.calib.harmonics[h][0] = refineSaveHarmonics[h][0];
+			lc.calib.harmonics[h][1] = refineSaveHarmonics[h][1];
 		}
 
-		// noice on the quadrant edges
-		if (up)
+		writeFlash((uint16_t*)&lc, sizeof(ConfigData) / sizeof(uint16_t));	// pauses the loop itself
+		refineSavePending = false;
+		refineLastSave = gTickCount;
+		refineSaves++;
+	}
+
+	if (!refineReady) return;
+
+	// only revolutions at a steady speed, slow enough to time each boundary
+
+	int period = refinePeriod;
+	int change = period - (int)refinePrevPeriod;
+	if (config->calib.calibrated && period >= refineMinPeriod && change < (period >> 5) && change > -(period >> 5))
+	{
+		for (int b = 0; b < refineBins; b++)
 		{
-			if ((q != 0 || prevQ != numQuadrants - 1) && q < prevQ) q = prevQ;
-			else if (q == numQuadrants - 1 && prevQ == 0) q = prevQ;
+			int order = ((b - refineFirst) * refineDir) & (refineBins - 1);
+			int position = (refineTimes[b] << 15) / period;
+			refineSum[b] += refineDir * ((order << refineBinShift) - position);
 		}
-		else
+		refineRevs++;
+	}
+	refinePrevPeriod = period;
+	refineReady = false;
+
+	if (refineRevs < refineRevolutions) return;
+
+	// refineSum is the mean error in Q4; fit its harmonics and take half of them out
+
+	int fit[calibHarmonics][2];
+	int residual = 0;										// what the set in use left over, Q4
+	for (int h = 0; h < calibHarmonics; h++)
+	{
+		int sc = 0, ss = 0;
+		for (int b = 0; b < refineBins; b++)
 		{
-			if ((q != numQuadrants - 1 || prevQ != 0) && q > prevQ) q = prevQ;
-			else if (q == 0 && prevQ == numQuadrants - 1) q = prevQ;
+			int phase = (h + 1) * b << refineBinShift;
+			sc += refineSum[b] * isin_table(phase + sin_period / 4) >> 12;
+			ss += refineSum[b] * isin_table(phase) >> 12;
 		}
 
-		if (q != prevQ)
+		fit[h][0] = sc >> refineBinBits;						// 2 / refineBins, halved
+		fit[h][1] = ss >> refineBinBits;
+		residual += (fit[h][0] < 0 ? -fit[h][0] : fit[h][0]) + (fit[h][1] < 0 ? -fit[h][1] : fit[h][1]);
+	}
+
+	if (refineFlashResidual < 0)
+	{
+		refineFlashResidual = residual;						// first batch after boot or a save runs the flash set
+	}
+	else if (!refineSavePending && refineSaves < refineMaxSaves &&
+		gTickCount - refineLastSave >= refineSaveInterval &&
+		refineFlashResidual - residual > refineSaveMinGain &&
+		residual < refineFlashResidual - (refineFlashResidual >> refineSaveMargin))
+	{
+		for (int h = 0; h < calibHarmonics; h++)
 		{
-			prevQ = q;			
+			refineSaveHarmonics[h][0] = activeHarmonics[h][0];	// the set that was measured, not the update
+			refineSaveHarmonics[h][1] = activeHarmonics[h][1];
 		}
-		if (firstQ == -1) firstQ = q;
-		prevQ = q;		
-		
-		awayFromFirst |= (q - firstQ  == numQuadrants / 2) || (firstQ - q == numQuadrants / 2);
-		backToFirst |= awayFromFirst && (q == firstQ);
-		if (backToFirst) break;
-		
-		if (qUp[q].minAngle > a) qUp[q].minAngle = a;
-		if (qUp[q].maxAngle < a) qUp[q].maxAngle = a;
-		
-		a += step * 2;
-		delay(1);
-		setPwm(a, calibPower);
+		refineFlashResidual = residual;
+		refineSavePending = true;							// written once the torque is zero
 	}
-		
-	for (int i = 0; i < numQuadrants; i++)
+
+	for (int h = 0; h < calibHarmonics; h++)
 	{
-		qUp[i].range = qUp[i].maxAngle - qUp[i].minAngle;
+		activeHarmonics[h][0] -= fit[h][0];
+		activeHarmonics[h][1] -= fit[h][1];
 	}
-	
-	//  up and down
-	
-	int qForth, qBack;
-	if (up)
+	buildCorrection();
+
+	refineRevs = 0;
+	for (int b = 0; b < refineBins; b++) refineSum[b] = 0;
+}
+
+// export / import -----------------------------------------------------------
+//
+// The calibration block is read straight from flash in chunks. Chunks written over the bus
+// collect in RAM and only reach flash once the whole block matches the host's CRC.
+// calibrate() borrows the staging table as scratch, stage after calibrating, not before.
+
+CalibrationData calibStaging;
+
+bool stageCalibration(int offset, const uint8_t* data, int count) {
+	if (offset < 0 || offset + count > (int)sizeof(CalibrationData)) return false;
+
+	memcpy((uint8_t*)&calibStaging + offset, data, count);
+	return true;
+}
+
+bool importCalibration(uint16_t crc) {
+	const CalibrationData& c = calibStaging;
+	if (crc16(&c, sizeof(CalibrationData)) != crc) return false;
+	if (!c.calibrated || c.polePairs < 1 || c.polePairs > maxPoles) return false;
+
+	ConfigData lc;
+	memcpy(&lc, config, sizeof(ConfigData));			// keep id and settings, replace calibration
+	memcpy(&lc.calib, &c, sizeof(CalibrationData));
+
+	writeFlash((uint16_t*)&lc, sizeof(ConfigData) / sizeof(uint16_t));
+	initCalibration();
+	refineReset();
+	return true;
+}
+
+// Fits the first calibHarmonics harmonics of the sensor error: the raw table minus the straight
+// line through one revolution, scaled from electric to sensor counts. Returns the pole pairs
+// the table spans, 0 if the rotor did not make a whole revolution.
+
+static int fitHarmonics(CalibrationData* c, int sdir) {
+	const int16_t* table = c->table;
+	int travel = 0;
+	for (int k = 0; k < calibTableSize; k++)
+		travel += wrapElectric(table[(k + 1) & calibBinMask] - table[k]);
+
+	int poles = ((travel < 0 ? -travel : travel) + sin_period / 2) >> 15;
+	if (poles == 0) return 0;
+
+	int slope = travel >> calibTableBits;					// electric counts per bin
+	int sum[calibHarmonics][2] = { 0 };
+	int e = table[0];
+	for (int k = 0; k < calibTableSize; k++)
 	{
-		qForth = q + 1;
-		if (qForth == numQuadrants) qForth = 0;
-		
-		qBack = q - 1;
-		if (qBack == -1) qBack = numQuadrants - 1;
+		int error = e - table[0] - slope * k;
+		for (int h = 0; h < calibHarmonics; h++)
+		{
+			int phase = (h + 1) * k << calibShift;
+			sum[h][0] += error * isin_table(phase + sin_period / 4) >> 12;
+			sum[h][1] += error * isin_table(phase) >> 12;
+		}
+		e += wrapElectric(table[(k + 1) & calibBinMask] - table[k]);
 	}
-	else
+
+	// coefficient = sum * 2 / calibTableSize electric counts, then * 16 / poles sensor counts Q4
+
+	for (int h = 0; h < calibHarmonics; h++)
 	{
-		qForth = q - 1;
-		if (qForth == -1) qForth = numQuadrants - 1;
-		
-		qBack = q + 1;
-		if (qBack == numQuadrants) qBack = 0;
+		c->harmonics[h][0] = sdir * sum[h][0] / (8 * poles);
+		c->harmonics[h][1] = sdir * sum[h][1] / (8 * poles);
 	}
-	
-	while (true)
+
+	return poles;
+}
+
+// Waits for the rotor to come to rest after a field step: two readings a tick apart
+// agree within the sensor noise. Returns the last reading.
+
+static int calibSettle() {
+	int prev = spiReadAngle();
+
+	for (int t = 0; t < calibSettleTicks; t++)
 	{
-		sensor = spiReadAngle();
-		q = sensor / quadrantDiv;
-		
-		if (q == qForth) break;
-		
-		a += step * 2;
 		delay(1);
-		setPwm(a, calibPower);
+		int sensor = spiReadAngle();
+		int d = wrapElectric(sensor - prev);
+		if (d <= calibSettleNoise && d >= -calibSettleNoise) return sensor;
+		prev = sensor;
 	}
-	
-	while (true)
+
+	return prev;
+}
+
+// Steps the field in dir until the sensor, moving by sdir bins, has passed skip + count
+// bin boundaries. The field angle at each of the last count boundaries is stored in table,
+// or averaged into it when average is set. Each step covers half the remaining distance
+// to the next boundary, using gain (field counts per sensor count, Q8), so quiet regions
+// take a few large steps and boundaries are approached finely. Returns false when the
+// time budget runs out.
+
+static bool calibSweep(int* a, int dir, int sdir, int gain, int skip, int count, int16_t* table, bool average) {
+	int sensor = calibSettle();
+	int bin = sensor >> calibShift;
+
+	while (skip + count > 0)
+	{
+		if (gTickCount - calibStart > calibBudget) return false;
+
+		int offset = sensor & ((1 << calibShift) - 1);
+		int distance = sdir > 0 ? (1 << calibShift) - offset : offset + 1;
+		int step = distance * gain >> 9;
+		if (step < calibMinStep) step = calibMinStep;
+		if (step > calibMaxStep) step = calibMaxStep;
+
+		*a += step * dir;
+		setPwm(*a, calibPower);
+		sensor = calibSettle();
+
+		int next = sensor >> calibShift;
+		int moved = ((next - bin) * sdir) & calibBinMask;
+		if (moved == 0 || moved > calibTableSize / 4) continue;	// no progress, or noise on the edge
+
+		for (; moved > 0 && skip + count > 0; moved--)
+		{
+			int boundary = (sdir > 0 ? bin + 1 : bin) & calibBinMask;
+			bin = (bin + sdir) & calibBinMask;
+
+			if (skip > 0)
+			{
+				skip--;
+				continue;
+			}
+
+			if (average)
+			{
+				int h = wrapElectric(*a - table[boundary]);
+				if (h < 0) h = -h;
+				hysteresisSum += h;
+				if (calibReport.hysteresisMax < h) calibReport.hysteresisMax = h;
+				uint8_t& segment = calibReport.hysteresis[boundary * calibReportSegments / calibTableSize];
+				if (segment < (h >> 4)) segment = h >> 4 > 255 ? 255 : h >> 4;
+
+				table[boundary] = (table[boundary] + (wrapElectric(*a - table[boundary]) >> 1)) & sin_mask;
+			}
+			else
+				table[boundary] = *a & sin_mask;
+			count--;
+		}
+	}
+
+	return true;
+}
+
+bool calibrate() {
+	int a = 0;
+	int sensor;
+	bool up;
+
+	stopControlLoop();									// calibration drives the field itself
+	refineReset();
+	calibStart = gTickCount;
+	calibReport = CalibrationReport();
+	hysteresisSum = 0;
+
+	ConfigData lc;
+	memcpy(&lc, config, sizeof(ConfigData));				// keep id and settings, replace calibration
+
+	// gently set 0 angle
+
+	for (int p = 0; p < calibPower / 10; p++)
 	{
-		sensor = spiReadAngle();
-		q = sensor / quadrantDiv;
-		
-		if (q == qBack) break;
-		
-		a -= step * 2;
 		delay(1);
-		setPwm(a, calibPower);
+		setPwm(0, p * 10);
 	}
-	
-	// full turn back
-	
-	awayFromFirst = false;
-	backToFirst = false;
-	firstQ = -1;
-	prevQ = q;
+
+	// move until the sensor is clearly away from the start, detect direction and gain
+
+	int sensorFirst = calibSettle();
+	int moved = 0;
+	bool ok = true;
 	while (true)
 	{
-		sensor = spiReadAngle();
-		q = sensor / quadrantDiv;
-		if (q != prevQ)
-		{
-			q1 = q;
-		}
-
-		// noice on the quadrant edges
-		if (up)
+		if (gTickCount - calibStart > calibBudget)
 		{
-			if ((q != numQuadrants - 1 || prevQ != 0) && q > prevQ) q = prevQ;
-			else if (q == 0 && prevQ == numQuadrants - 1) q = prevQ;
-		}
-		else
-		{
-			if ((q != 0 || prevQ != numQuadrants - 1) && q < prevQ) q = prevQ;
-			else if (q == numQuadrants - 1 && prevQ == 0) q = prevQ;
+			ok = false;
+			break;
 		}
 
-		if (q != prevQ)
-		{
-			prevQ = q;
-		}
-		if (firstQ == -1) firstQ = q;
-		prevQ = q;
-		
-		awayFromFirst |= (q - firstQ  == numQuadrants / 2) || (firstQ - q == numQuadrants / 2);
-		backToFirst |= awayFromFirst && (q == firstQ);
-		if (backToFirst) break;
-		
-		if (qDn[q].minAngle > a) qDn[q].minAngle = a;
-		if (qDn[q].maxAngle < a) qDn[q].maxAngle = a;
-		
-		a -= step * 2;
-		delay(1);
+		a += calibDetectStep;
 		setPwm(a, calibPower);
+		sensor = calibSettle();
+
+		moved = wrapElectric(sensor - sensorFirst);
+		if (moved > calibDetectDistance || moved < -calibDetectDistance) break;
 	}
-	
+	up = moved > 0;
+	int sdir = up ? 1 : -1;
+	int gain = ok ? (a << 8) / (up ? moved : -moved) : 0;
+
+	// full turn forward, then a little further so the backward pass starts with the lag reversed,
+	// then a full turn back, averaged with the forward pass to cancel friction lag
+
+	ok = ok && calibSweep(&a, 1, sdir, gain, calibSettleBins, calibTableSize, lc.calib.table, false);
+	ok = ok && calibSweep(&a, 1, sdir, gain, calibSettleBins, 0, lc.calib.table, false);
+	ok = ok && calibSweep(&a, -1, -sdir, gain, calibSettleBins, calibTableSize, lc.calib.table, true);
+
 	// gently release
-	
+
 	for (int p = calibPower / 10; p > 0; p--)
 	{
 		delay(1);
@@ -250,32 +609,268 @@ void calibrate() {
 	}
 
 	setPwm(0, 0);
-	
-	ConfigData lc;
-	lc.controllerId = config->controllerId;	
-	
-	for (int i = 0; i < numQuadrants; i++)
-	{
-		qDn[i].range = qDn[i].maxAngle - qDn[i].minAngle;
-	}	
-	
-	// calc average quadrants
-	
+
+	// fit the eccentricity, then resample the table onto the corrected sensor angle
+
+	int poles = ok ? fitHarmonics(&lc.calib, sdir) : 0;
+	calibReport.duration = gTickCount - calibStart;
+	calibReport.up = up;
+	calibReport.polePairs = poles;
+	calibReport.hysteresisMean = hysteresisSum >> calibTableBits;
+	if (poles < 1 || poles > maxPoles)
+	{
+		calibReport.status = ok ? calibStatusBadPoles : calibStatusTimeout;
+		startControlLoop();								// out of time or implausible motor, keep the previous calibration
+		return false;
+	}
+
+	lc.calib.polePairs = poles;
+	lc.calib.calibrated = true;
+	setHarmonics(&lc.calib);
+	refineReset();
+
+	int16_t* raw = calibStaging.table;					// scratch, not another 512 bytes of stack; drops a staged import
+	memcpy(raw, lc.calib.table, sizeof(calibStaging.table));
+	for (int k = 0; k < calibTableSize; k++)
+	{
+		int x = k << calibShift;
+		int s = x;
+		for (int n = 0; n < 3; n++) s = x - sensorCorrection(s);	// invert s + correction(s) = x
+		lc.calib.table[k] = calibLookup(raw, s) & sin_mask;
+	}
+
+	// electric angle per bin, for the report
+
 	int minRange;
 	int maxRange;
-	for (int i = 0; i < numQuadrants; i++)
+	for (int i = 0; i < calibTableSize; i++)
 	{
-		lc.quadrants[i].minAngle = (qUp[i].minAngle + qDn[i].minAngle) / 2;
-		lc.quadrants[i].maxAngle = (qUp[i].maxAngle + qDn[i].maxAngle) / 2;
-		int range = lc.quadrants[i].maxAngle - lc.quadrants[i].minAngle;
-		lc.quadrants[i].range = range;
-		
+		int range = wrapElectric(lc.calib.table[(i + 1) & calibBinMask] - lc.calib.table[i]) * sdir;
+
 		if (i == 0 || minRange > range) minRange = range;
 		if (i == 0 || maxRange < range) maxRange = range;
 	}
-	
+
+	calibReport.minRange = minRange;
+	calibReport.maxRange = maxRange;
+	calibReport.status = calibStatusOk;
+
 	// store in flash
-	lc.calibrated = true;
-	lc.up = up;
+	lc.calib.up = up;
+	writeFlash((uint16_t*)&lc, sizeof(ConfigData) / sizeof(uint16_t));
+
+	startControlLoop();
+	return true;
+}
+
+// Re-zero: when only the electric offset moved, e.g. the motor was reassembled with the same
+// sensor, energize a few electric angles, compare them with what the table says and shift
+// the whole table by the mean difference. Each angle is approached in both directions.
+// Differences that disagree mean more than the offset moved, flash is left alone then.
+
+const int rezeroPoints = 4;
+const int rezeroRamp = 100;								// power step per tick when energizing
+const int rezeroSpread = sin_period / 16;				// electric counts between the differences, beyond needs calibrate()
+
+bool rezero() {
+	if (!config->calib.calibrated) return false;
+
+	stopControlLoop();
+	refineReset();
+
+	for (int p = 0; p < calibPower; p += rezeroRamp)
+	{
+		delay(1);
+		setPwm(0, p);
+	}
+
+	int a = 0;
+	int first = 0, sum = 0, low = 0, high = 0;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (int k = 0; k < rezeroPoints; k++)
+		{
+			int target = (pass == 0 ? k + 1 : rezeroPoints - 1 - k) * (sin_period / rezeroPoints);
+			while (a != target)
+			{
+				int step = target - a;
+				if (step > calibMaxStep) step = calibMaxStep;
+				if (step < -calibMaxStep) step = -calibMaxStep;
+				a += step;
+				setPwm(a, calibPower);
+				calibSettle();
+			}
+
+			int d = wrapElectric(a - getElectricDegrees(correctSensor(calibSettle())));
+			if (pass == 0 && k == 0) first = d;
+			d = wrapElectric(d - first);						// relative to the first, an offset near half a turn must not wrap
+			sum += d;
+			if (d < low) low = d;
+			if (d > high) high = d;
+		}
+	}
+
+	for (int p = calibPower; p > 0; p -= rezeroRamp)
+	{
+		delay(1);
+		setPwm(a, p);
+	}
+	setPwm(0, 0);
+
+	if (high - low > rezeroSpread)
+	{
+		startControlLoop();								// the table does not just need a shift
+		return false;
+	}
+
+	int offset = first + sum / (2 * rezeroPoints);
+
+	ConfigData lc;
+	memcpy(&lc, config, sizeof(ConfigData));
+	for (int k = 0; k < calibTableSize; k++)
+		lc.calib.table[k] = (lc.calib.table[k] + offset) & sin_mask;
+
+	writeFlash((uint16_t*)&lc, sizeof(ConfigData) / sizeof(uint16_t));
+	startControlLoop();
+	return true;
+}
+
+// Sensor tuning: the MA700 corrects an off-axis magnet by boosting one axis (BCT). Each
+// candidate is judged by stepping the field through one revolution and taking the peak
+// to peak deviation of the raw angle from the field; friction lag is a constant and
+// cancels. The winner is stored and the table rebuilt, it only holds for one setting.
+// The MA700 has no volatile register image: BCT and axis live in NVM only, so every
+// candidate is an NVM write and the sweep cannot be staged and committed once. Instead
+// each axis is searched coarse to fine, 8 candidates instead of 16, and the number of
+// runs is kept in the config page and capped. Candidates turn alternately forward and
+// back, the rotor ends where it started and spiTurns stays right.
+
+const int tuneCoarseStep = 64;							// 4 values per axis, then halved down to tuneBctStep
+const int tuneBctStep = 16;
+const int tuneCandidates = 2 * (256 / tuneCoarseStep + 4);
+const int tunePoints = 64;								// per revolution
+const int tuneMaxRuns = 16;								// per unit, about 20 NVM writes each
+
+static_assert(tuneCoarseStep == 4 * tuneBctStep, "two refinement steps per axis");
+static_assert(tuneCandidates % 2 == 0, "an odd number of candidates leaves the rotor a turn off");
+
+static int tuneMeasure(int* a, int dir) {
+	int sign = config->calib.up ? dir : -dir;
+	int span = dir * sin_period * config->calib.polePairs / tunePoints;
+	int first = 0, low = 0, high = 0;
+
+	for (int k = 0; k <= tunePoints; k++)
+	{
+		int target = *a + (k ? span : 0);
+		while (*a != target)
+		{
+			int step = target - *a;
+			if (step > calibMaxStep) step = calibMaxStep;
+			if (step < -calibMaxStep) step = -calibMaxStep;
+			*a += step;
+			setPwm(*a, calibPower);
+			calibSettle();
+		}
+
+		int sensor = calibSettle();
+		if (k == 0) first = sensor;
+		int d = wrapElectric(sensor - first - sign * k * (sin_period / tunePoints));
+		if (d < low) low = d;
+		if (d > high) high = d;
+	}
+
+	return high - low;
+}
+
+static int tuneTry(int* a, int* dir, int bct, int axis) {
+	spiSetCorrection(bct, axis);
+	int error = tuneMeasure(a, *dir);
+	*dir = -*dir;
+	return error;
+}
+
+static void saveSensorCorrection(int bct, int axis, int runs) {
+	spiSetCorrection(bct, axis);
+
+	ConfigData lc;
+	memcpy(&lc, config, sizeof(ConfigData));
+	lc.spiBct = bct;
+	lc.spiAxis = axis;
+	lc.tuneRuns = runs;
 	writeFlash((uint16_t*)&lc, sizeof(ConfigData) / sizeof(uint16_t));
-}
\ No newline at end of file
+}
+
+bool tuneSensor() {
+	if (!config->calib.calibrated) return false;		// needs pole pairs and direction
+	int runs = config->tuneRuns == 0xFF ? 1 : config->tuneRuns + 1;
+	if (runs > tuneMaxRuns) return false;				// sensor NVM endurance
+
+	stopControlLoop();
+	refineReset();
+
+	for (int p = 0; p < calibPower; p += rezeroRamp)
+	{
+		delay(1);
+		setPwm(0, p);
+	}
+
+	int a = 0;
+	int dir = 1;
+	int best = sin_period, bestBct = config->spiBct, bestAxis = config->spiAxis;
+	for (int axis = spiAxisX; axis <= spiAxisY; axis <<= 1)
+	{
+		int axisBest = sin_period, axisBct = 0;
+		for (int bct = 0; bct < 256; bct += tuneCoarseStep)
+		{
+			int error = tuneTry(&a, &dir, bct, axis);
+			if (error < axisBest)
+			{
+				axisBest = error;
+				axisBct = bct;
+			}
+		}
+
+		for (int step = tuneCoarseStep / 2; step >= tuneBctStep; step >>= 1)
+		{
+			int center = axisBct;
+			for (int side = -1; side <= 1; side += 2)
+			{
+				int bct = center + side * step;
+				if (bct < 0) bct = 0;							// measured again, no NVM write
+				int error = tuneTry(&a, &dir, bct, axis);
+				if (error < axisBest)
+				{
+					axisBest = error;
+					axisBct = bct;
+				}
+			}
+		}
+
+		if (axisBest < best)
+		{
+			best = axisBest;
+			bestBct = axisBct;
+			bestAxis = axis;
+		}
+	}
+
+	for (int p = calibPower; p > 0; p -= rezeroRamp)
+	{
+		delay(1);
+		setPwm(a, p);
+	}
+	setPwm(0, 0);
+
+	int oldBct = config->spiBct, oldAxis = config->spiAxis;
+	if (oldAxis != spiAxisX && oldAxis != spiAxisY)		// erased flash, initSpi() used the defaults
+	{
+		oldBct = 160;
+		oldAxis = spiAxisY;
+	}
+
+	saveSensorCorrection(bestBct, bestAxis, runs);
+	if (calibrate()) return true;
+
+	saveSensorCorrection(oldBct, oldAxis, runs);				// the old table still matches the old setting
+	return false;
+}
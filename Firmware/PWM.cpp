@@ -6,6 +6,28 @@ const int phase2 = sin_period / 3;
 const int phase3 = sin_period * 2 / 3;
 const int ninetyDeg = sin_period / 4;
 
+#define SIN_TABLE								// table-driven sine in setPwm (comment out to use isin_S3)
+
+const int sinTableBits = 8;						// quarter-wave resolution, 2^8 entries
+const int sinTableSize = 1 << sinTableBits;
+const int sinTableShift = 13 - sinTableBits;	// quarter circle is 2^13 angle units
+
+// sensor sampled on update n, duty loaded on update n+1 and centered half a period later
+const int defaultCommutationDelay = 384;		// 1.5 control periods, Q8
+
+int commutationDelay = defaultCommutationDelay;	// used to extrapolate the angle, 0 = off
+
+const int minMaxGain = 4729;					// 2/sqrt(3) in Q12, min-max injection peaks at sqrt(3)/2
+
+const int pwmScaleMul = (1 << 29) / (sin_range * timer_scale);	// 1 / sin_range / timer_scale, Q29, folded at compile time
+
+int pwmMode = pwmModeSine;
+
+volatile unsigned int controlCycles = 0;		// control periods executed
+volatile unsigned int controlOverruns = 0;		// periods that ran into the next update event
+volatile int controlMaxDelay = 0;				// worst TIM1 counts from update event to control start
+volatile int controlMaxLatency = 0;				// worst TIM1 counts from update event to new duty written
+
 /// A sine approximation via a third-order approx.
 /// @param x    Angle (with 2^15 units/circle)
 /// @return     Sine value (Q12)
@@ -30,6 +52,105 @@ int isin_S3(int x)
 	return x * ((3 << qP) - (x*x >> qR)) >> qS;
 }
 
+/// sin(x) for x in [0, pi/2] via Taylor series, used to generate the table at compile time only
+constexpr double taylorSin(double x)
+{
+	double term = x;
+	double sum = x;
+	
+	for (int n = 1; n < 12; n++)
+	{
+		term *= -x * x / ((2 * n) * (2 * n + 1));
+		sum += term;
+	}
+	return sum;
+}
+
+struct SinTable
+{
+	int16_t v[sinTableSize + 1];				// one extra entry to interpolate up to pi/2
+	
+	constexpr SinTable() : v()
+	{
+		for (int i = 0; i <= sinTableSize; i++)
+			v[i] = (int16_t)(taylorSin(1.57079632679489661923 * i / sinTableSize) * (1 << 12) + 0.5);
+	}
+};
+
+constexpr SinTable sinTable;					// Q12 quarter-wave, lives in flash
+
+/// A sine approximation via quarter-wave table with linear interpolation.
+/// @param x    Angle (with 2^15 units/circle)
+/// @return     Sine value (Q12)
+int isin_table(int x)
+{
+	int q = x & (ninetyDeg - 1);				// position within the quadrant
+	if (x & ninetyDeg) q = ninetyDeg - q;		// quadrants 1 and 3 are mirrored
+	
+	int i = q >> sinTableShift;
+	int f = q & ((1 << sinTableShift) - 1);
+	
+	int y = sinTable.v[i];
+	if (f) y += (sinTable.v[i + 1] - y) * f >> sinTableShift;
+	
+	return (x & (sin_period / 2)) ? -y : y;		// quadrants 2 and 3 are negative
+}
+
+/// TIM1 counts since the update event that started this period.
+/// @param down    Counting direction right after that update event
+int controlElapsed(bool down)
+{
+	int cnt = TIM1->CNT;
+	bool downNow = (TIM1->CR1 & TIM_CR1_DIR) != 0;
+	
+	int elapsed = downNow ? TIM1->ARR - cnt : cnt;
+	if (downNow != down) elapsed += TIM1->ARR;		// passed the opposite end of the center-aligned count
+	
+	return elapsed;
+}
+
+/// One control period. Runs from the SPI DMA interrupt once the angle sampled on the
+/// TIM1 update event has arrived; the new duty takes effect on the next update event.
+void controlPeriod() {
+	bool down = (TIM1->CR1 & TIM_CR1_DIR) != 0;		// update fires at either end, see RM0091 on odd RCR
+	TIM1->SR = ~TIM_SR_UIF;							// clear the update flag of this period
+	
+	int entry = controlElapsed(down);				// sensor transfer and interrupt entry
+	if (controlMaxDelay < entry) controlMaxDelay = entry;
+	
+	setPwmTorque();
+	
+	int latency = controlElapsed(down);				// sample to duty written
+	if (controlMaxLatency < latency) controlMaxLatency = latency;
+	
+	if (TIM1->SR & TIM_SR_UIF) controlOverruns++;	// next period already started
+	controlCycles++;
+}
+
+bool controlLoopRunning = false;
+
+void startControlLoop() {
+	controlLoopRunning = true;
+#ifdef CONTROL_IN_TIMER
+	spiStartDma();
+#endif
+}
+void stopControlLoop() {
+	controlLoopRunning = false;
+#ifdef CONTROL_IN_TIMER
+	spiStopDma();
+#endif
+}
+
+inline int isin(int x)
+{
+#ifdef SIN_TABLE
+	return isin_table(x);
+#else
+	return isin_S3(x);
+#endif
+}
+
 void initPwm() {
 	TIM1->ARR = sin_range / timer_scale;							// tim1 period, about 20kHz
 
@@ -116,41 +237,68 @@ void initPwm() {
 
 	GPIOA->BRR = (1 << 11);								// reset pin 11 (overcurrent does not effect gate driver directly)
 	GPIOF->BSRR = (1 << 7);								// disable stand-by mode	
+	
+	setCommutationDelay(config->commutationDelay);
+}
+void setPwmMode(int mode) {
+	pwmMode = mode;
 }
 void setPwm(int angle, int power) {
-//	angle = POSITIVE_MODULO(angle, sin_period);
-//	
-//	int a1 = angle;
-//	int a2 = POSITIVE_MODULO((angle + phase2), sin_period);
-//	int a3 = POSITIVE_MODULO((angle + phase3), sin_period);
-	
-	int a1 = angle % sin_period;
-	int a2 = (angle + phase2) % sin_period;
-	int a3 = (angle + phase3) % sin_period;
-	
-	if (a1 < 0) a1 += sin_period;
-	if (a2 < 0) a2 += sin_period;
-	if (a3 < 0) a3 += sin_period;
-	
-	a1 = isin_S3(a1) + sin_zero;
-	a2 = isin_S3(a2) + sin_zero;
-	a3 = isin_S3(a3) + sin_zero;
-	
-	TIM1->CCR1 = a1 * power / sin_range / timer_scale;
-	TIM1->CCR2 = a2 * power / sin_range / timer_scale;
-	TIM1->CCR3 = a3 * power / sin_range / timer_scale;
+	int pwmScale = power * pwmScaleMul >> 13;			// Q16, a multiply, the feed-forward changes power every period
+	
+	int a1 = angle & sin_mask;							// sin_period is 2^15, masking wraps negatives too
+	int a2 = (angle + phase2) & sin_mask;
+	int a3 = (angle + phase3) & sin_mask;
+	
+	a1 = isin(a1);
+	a2 = isin(a2);
+	a3 = isin(a3);
+	
+	if (pwmMode == pwmModeMinMax)
+	{
+		// zero-sequence injection: center the min and max phases, line-to-line shape unchanged
+		
+		int max = a1 > a2 ? a1 : a2;
+		int min = a1 > a2 ? a2 : a1;
+		if (a3 > max) max = a3;
+		if (a3 < min) min = a3;
+		
+		int zero = (max + min) >> 1;
+		a1 = (a1 - zero) * minMaxGain >> 12;			// stretch back to the full sin_range swing
+		a2 = (a2 - zero) * minMaxGain >> 12;
+		a3 = (a3 - zero) * minMaxGain >> 12;
+	}
+	
+	a1 += sin_zero;
+	a2 += sin_zero;
+	a3 += sin_zero;
+	
+	TIM1->CCR1 = a1 * pwmScale >> 16;
+	TIM1->CCR2 = a2 * pwmScale >> 16;
+	TIM1->CCR3 = a3 * pwmScale >> 16;
+}
+void setCommutationDelay(int delay) {
+	commutationDelay = (delay == 0xFFFF) ? defaultCommutationDelay : delay;
 }
 void setPwmTorque() {
-	int a = getElectricDegrees();
+	// where the rotor will be while this duty is applied: velocity (Q17 -> Q8) times delay (Q8)
+	
+	int advance = (observerVelocity >> 9) * commutationDelay >> 16;
+	int a = getElectricDegrees(spiCurrentAngle + advance);
+	
+	int torque = usartTorqueCommandValue;
+	if (coggingActive) torque += cogFeedForward(a);
+	if (torque > sin_range) torque = sin_range;
+	if (torque < -sin_range) torque = -sin_range;
 	
-	if (usartTorqueCommandValue > 0)
+	if (torque > 0)
 	{
 		a += ninetyDeg;
-		setPwm(a, usartTorqueCommandValue);
+		setPwm(a, torque);
 	}
 	else
 	{
 		a -= ninetyDeg;
-		setPwm(a, -usartTorqueCommandValue);
+		setPwm(a, -torque);
 	}
 }
\ No newline at end of file
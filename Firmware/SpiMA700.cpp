@@ -1,10 +1,20 @@
 #include <main.h>
 
-int spiPrevSensor = 0;
-int spiCorrection = 0;
-int spiCurrentAngle = 0;
+volatile int spiPrevSensor = 0;						// last corrected angle, fraction of the multi-turn position
+volatile int spiTurns = 0;							// full revolutions since power-up
+volatile int spiCurrentAngle = 0;
 long firValue = 0;
 
+uint32_t observerPosition = 0;						// tracked angle, 2^32 per revolution
+volatile int observerVelocity = 0;					// same units per control period
+volatile int observerAcceleration = 0;				// same units per control period^2, low-passed
+int observerShift = 5;
+
+bool spiPending = false;							// read-ahead frame in flight (pipelined mode)
+
+uint16_t spiDmaTxWord = 0xffff;						// clocked out on every TIM1 update
+volatile uint16_t spiDmaRxWord = 0;					// angle sampled on the TIM1 update
+
 //#define DO_FILTERING
 
 extern "C"
@@ -12,30 +22,42 @@ void SPI1_IRQHandler() {
 	// should be empty
 }
 
+extern "C"
+void DMA1_Channel2_3_IRQHandler() {
+	if (DMA1->ISR & DMA_ISR_TCIF2)						// SPI1 RX complete on channel 2
+	{
+		DMA1->IFCR |= DMA_IFCR_CTCIF2;					// clear "transfer complete" flag of channel 2
+		
+		spiUpdateAngle(spiDmaRxWord >> 1);
+		controlPeriod();
+	}
+	if (DMA1->ISR & DMA_ISR_TCIF3)						// USART1 RX ring wrapped on channel 3
+	{
+		DMA1->IFCR |= DMA_IFCR_CTCIF3;
+		usartRecvWrapped();
+	}
+}
+
 #define CMD_WRITE	(0b0010 << 12)
 #define CMD_READ	(0b0001 << 12)
 #define REG_BCT		(3 << 8)
 #define REG_ZERO	(4 << 8)
 #define REG_AXIS	(5 << 8)
-#define AXIS_X		(1 << 4)
-#define AXIS_Y		(1 << 5)
 
 uint16_t SpiWriteRead(uint16_t data){
-	GPIOA->BRR |= 1 << 4;								// A-4 down - enable CS 
+	// CS (A-4) is driven by hardware NSS and pulses high after each frame
 	
 	while ((SPI1->SR & SPI_SR_TXE) != SPI_SR_TXE) {}	// wait till transmit buffer empty
 	*((__IO uint16_t *)&SPI1->DR) = data;				// write
 	while ((SPI1->SR & SPI_SR_BSY) == SPI_SR_BSY) {}	// wait till end of transmission
 	
 	while ((SPI1->SR & SPI_SR_RXNE) != SPI_SR_RXNE) {}	// wait for input buffer
-
-	GPIOA->BSRR |= 1 << 4;								// A-4 up - disable CS 
 	
 	return *((__IO uint16_t *)&SPI1->DR);	
 }
 
 void initSpi() {
-	GPIOA->MODER |= (0b01 << GPIO_MODER_MODER4_Pos) |	// output for pin A-4 (CS)
+	GPIOA->MODER |= (0x02 << GPIO_MODER_MODER4_Pos) |	// alt func mode for pin A-4 (NSS as CS)
 		            (0x02 << GPIO_MODER_MODER5_Pos) |	// alt func mode for pin A-5 (SCK)
 					(0x02 << GPIO_MODER_MODER6_Pos) |	// alt func mode for pin A-6 (MISO)
 		            (0x02 << GPIO_MODER_MODER7_Pos);	// alt func mode for pin A-7 (MOSI)
@@ -45,54 +67,184 @@ void initSpi() {
 					  GPIO_OSPEEDR_OSPEEDR6 |			// high speed for pin A-6 (MISO)
 				      GPIO_OSPEEDR_OSPEEDR7;			// high speed for pin A-7 (MOSI)
 	
-	GPIOA->AFR[0] |= (0x00 << GPIO_AFRL_AFSEL5_Pos) |	// alternative funciton 0 for pin A-5
+	GPIOA->AFR[0] |= (0x00 << GPIO_AFRL_AFSEL4_Pos) |	// alternative funciton 0 for pin A-4
+					 (0x00 << GPIO_AFRL_AFSEL5_Pos) |	// alternative funciton 0 for pin A-5
 					 (0x00 << GPIO_AFRL_AFSEL6_Pos) |	// alternative funciton 0 for pin A-6
 		             (0x00 << GPIO_AFRL_AFSEL7_Pos);	// alternative funciton 0 for pin A-7
-
-	GPIOA->BSRR |= 1 << 4;								// CS high (disable)
 	
 	//
 	
 	SPI1->CR1 |= //SPI_CR1_BIDIMODE |			// half-duplex mode
 		         //SPI_CR1_BIDIOE |				// output mode
-				 SPI_CR1_SSM |					// software slave management
-		         SPI_CR1_SSI |					// internal slave select
 		//
-				 SPI_CR1_CPOL |					// CK to 1 when idle
-		         SPI_CR1_CPHA |					// The second clock transition is the first data capture edge
+		         //SPI_CR1_CPOL |				// mode 0 (MA700 takes 0 or 3), NSS pulses need CPHA = 0
+		         //SPI_CR1_CPHA |
 		//
 		         (0b011 << SPI_CR1_BR_Pos) |	// baud rate = PCLK/16
 		         SPI_CR1_MSTR;					// master mode
 		
 	SPI1->CR2 |= //SPI_CR2_FRXTH |				// RXNE event is generated if the FIFO level is greater than or equal to 1/4 (8-bit)
+		         SPI_CR2_SSOE |					// hardware NSS output
+		         SPI_CR2_NSSP |					// NSS high between frames, so each frame is one CS cycle
 		         (0b1111 << SPI_CR2_DS_Pos);	// data size = 16 bit
 //		
 	SPI1->CR1 |= SPI_CR1_SPE;					// SPI enable
 	
-	// send calibration value
+	spiApplyConfig();							// prescaler from config, flushes the first frame
+	
+	// linearity correction, tuned per unit by tuneSensor()
+	
+	if (config->spiAxis == spiAxisX || config->spiAxis == spiAxisY)
+		spiSetCorrection(config->spiBct, config->spiAxis);
+	else
+		spiSetCorrection(160, spiAxisY);				// erased flash
+	
+	spiPrevSensor = correctSensor(spiReadAngle());	// multi-turn position starts in turn 0
+	observerPosition = (uint32_t)spiPrevSensor << 17;
+	
+	// DMA: channel 5 writes the read command on TIM1 update, channel 2 collects the angle
 	
-	SpiWriteRead(CMD_WRITE | REG_BCT | 160);	// correction value=160
-	SpiWriteRead(CMD_WRITE | REG_AXIS | AXIS_Y);// correction axis=Y
+	RCC->AHBENR |= RCC_AHBENR_DMA1EN;					// enable clock for DMA
 	
-	int readBct = SpiWriteRead(CMD_READ | REG_BCT) & 0xFF;
-	int readAxis = SpiWriteRead(CMD_READ | REG_AXIS) & 0xFF;
+	DMA1_Channel5->CPAR = (uint32_t)(&(SPI1->DR));		// SPI DR is destination
+	DMA1_Channel5->CMAR = (uint32_t)(&spiDmaTxWord);	// source
+	DMA1_Channel5->CCR |= DMA_CCR_DIR |					// memory to peripheral
+		                  DMA_CCR_CIRC |				// circular mode, re-armed for every update
+		                  (0b01 << DMA_CCR_MSIZE_Pos) |	// 16 bit memory
+		                  (0b01 << DMA_CCR_PSIZE_Pos) |	// 16 bit peripheral
+		                  (0b11 << DMA_CCR_PL_Pos);		// priority = very high
+	
+	DMA1_Channel2->CPAR = (uint32_t)(&(SPI1->DR));		// SPI DR is source
+	DMA1_Channel2->CMAR = (uint32_t)(&spiDmaRxWord);	// destination
+	DMA1_Channel2->CCR |= DMA_CCR_CIRC |				// circular mode, re-armed for every update
+		                  DMA_CCR_TCIE |				// interrupt on full transfer
+		                  (0b01 << DMA_CCR_MSIZE_Pos) |	// 16 bit memory
+		                  (0b01 << DMA_CCR_PSIZE_Pos) |	// 16 bit peripheral
+		                  (0b11 << DMA_CCR_PL_Pos);		// priority = very high
+	
+	NVIC_SetPriority(DMA1_Channel2_3_IRQn, 0);			// control loop preempts buttons
+	NVIC_EnableIRQ(DMA1_Channel2_3_IRQn);
+}
+
+void spiApplyConfig() {
+	observerShift = config->observerShift;
+	if (observerShift < 2 || observerShift > 12) observerShift = 5;
+	
+	int br = config->spiPrescaler;
+	if (br > 7) br = 3;									// erased flash, keep PCLK/16
+	
+	while ((SPI1->SR & SPI_SR_BSY) == SPI_SR_BSY) {}	// let the frame in flight finish
+	
+	SPI1->CR1 &= ~SPI_CR1_SPE;							// baud rate is changed with SPI disabled
+	SPI1->CR1 = (SPI1->CR1 & ~SPI_CR1_BR_Msk) | (br << SPI_CR1_BR_Pos);
+	SPI1->CR1 |= SPI_CR1_SPE;
+	
+	while (SPI1->SR & SPI_SR_RXNE) { (void)SPI1->DR; }
+	spiPending = false;
+	SpiWriteRead(0xffff);								// NSS went low with SPE, flush that first frame
 }
 
+void spiStartDma() {
+	while ((SPI1->SR & SPI_SR_BSY) == SPI_SR_BSY) {}	// a pipelined read may be in flight
+	while (SPI1->SR & SPI_SR_RXNE) { (void)SPI1->DR; }	// drain leftovers of blocking reads
+	spiPending = false;
+	
+	DMA1_Channel5->CNDTR = 1;
+	DMA1_Channel2->CNDTR = 1;
+	DMA1_Channel5->CCR |= DMA_CCR_EN;					// enable DMA channel 5
+	DMA1_Channel2->CCR |= DMA_CCR_EN;					// enable DMA channel 2
+	
+	SPI1->CR2 |= SPI_CR2_RXDMAEN;						// RX requests to DMA
+	TIM1->DIER |= TIM_DIER_UDE;							// TIM1 update requests to DMA
+}
+void spiStopDma() {
+	TIM1->DIER &= ~TIM_DIER_UDE;						// no more triggers
+	while ((SPI1->SR & SPI_SR_BSY) == SPI_SR_BSY) {}	// let the frame in flight finish
+	
+	DMA1_Channel2->CCR &= ~DMA_CCR_EN;					// disable channel 2
+	DMA1_Channel5->CCR &= ~DMA_CCR_EN;					// disable channel 5
+	DMA1->IFCR |= DMA_IFCR_CGIF2 | DMA_IFCR_CGIF5;		// clear all flags of channels 2 and 5
+	
+	SPI1->CR2 &= ~SPI_CR2_RXDMAEN;
+	while (SPI1->SR & SPI_SR_RXNE) { (void)SPI1->DR; }	// blocking reads start from an empty FIFO
+}
+
+void spiDropPending() {
+	if (spiPending)										// drop the read-ahead, the caller wants a fresh frame
+	{
+		while ((SPI1->SR & SPI_SR_RXNE) != SPI_SR_RXNE) {}
+		(void)SPI1->DR;
+		spiPending = false;
+	}
+}
+int spiReadRegister(int reg) {
+	spiDropPending();
+	
+	SpiWriteRead(CMD_READ | reg);
+	return SpiWriteRead(0xffff) >> 8;					// the value comes back in the next frame
+}
+void spiWriteRegister(int reg, int value) {
+	if (spiReadRegister(reg) == value) return;			// registers live in NVM with limited endurance
+	
+	SpiWriteRead(CMD_WRITE | reg | value);
+	delay(20);											// NVM write time
+	SpiWriteRead(0xffff);								// answer carries the new value
+}
+void spiSetCorrection(int bct, int axis) {
+	spiWriteRegister(REG_BCT, bct);
+	spiWriteRegister(REG_AXIS, axis);
+}
 int spiReadAngle() {
+	spiDropPending();
+	
 	uint16_t data = SpiWriteRead(0xffff);
 	return data >> 1;									// leave 15 bit as required by sin
 }
-void spiReadAngleFiltered() {
-	int a = spiReadAngle();
+void spiGetPosition(int* turns, int* angle) {
+	__disable_irq();									// both halves from the same sample
+	*turns = spiTurns;
+	*angle = spiPrevSensor;
+	__enable_irq();
+}
+int spiReadAngleNext() {
+	if (!spiPending) *((__IO uint16_t *)&SPI1->DR) = 0xffff;
 	
-#ifdef DO_FILTERING	
+	while ((SPI1->SR & SPI_SR_RXNE) != SPI_SR_RXNE) {}	// normally done long ago
+	uint16_t data = *((__IO uint16_t *)&SPI1->DR);
+	
+	*((__IO uint16_t *)&SPI1->DR) = 0xffff;				// start the next one right away
+	spiPending = true;
+	
+	return data >> 1;
+}
+void spiReadAngleFiltered() {
+	if (config->spiPipelined == 1) spiUpdateAngle(spiReadAngleNext());
+	else spiUpdateAngle(spiReadAngle());
+}
+void spiUpdateAngle(int a) {
+	a = correctSensor(a);										// remove magnet eccentricity
+#ifdef CALIB_REFINE
+	calibRefineSample(a);
+#endif
 	
-	if (a - spiPrevSensor > 16384) spiCorrection -= 32786;
-	else if (a - spiPrevSensor < -16384) spiCorrection += 32786;
+	if (a - spiPrevSensor > SENSOR_MAX / 2) spiTurns--;			// wrapped backwards through zero
+	else if (a - spiPrevSensor < -SENSOR_MAX / 2) spiTurns++;	// wrapped forwards through zero
 	
 	spiPrevSensor = a;
 	
-	a += spiCorrection;
+	// tracking observer: critically damped PLL, kp = 2w and ki = w^2 with w = 2^-observerShift
+	
+	observerPosition += observerVelocity;						// predict
+	int err = (int)(((uint32_t)a << 17) - observerPosition);	// wraps with the revolution
+	int inc = err >> (2 * observerShift);
+	
+	observerPosition += err >> (observerShift - 1);
+	observerVelocity += inc;
+	observerAcceleration += (inc - observerAcceleration) >> observerShift;
+	
+#ifdef DO_FILTERING	
+	
+	a += spiTurns * SENSOR_MAX;
 	
 	long sample = (long)a * 0x800;
 	firValue += (sample - firValue) / 0x80;
@@ -2,45 +2,168 @@
 
 const uint8_t mainboardId = 0x00;
 const uint8_t broadcastId = 0xFF;
-const uint sendBufferSize = 10;
+const uint sendBufferSize = 80;							// fits the calibration report
 volatile unsigned char sendBuffer[sendBufferSize] = { 0 };
 
-const uint recvBufferSize = 32;
+const uint recvBufferSize = 64;							// fits a calibration write chunk
+const uint recvMask = recvBufferSize - 1;				// ring indices wrap with a mask
 volatile unsigned char recvBuffer[recvBufferSize] = { 0 };
-char* recvBufferEnd = (char*)recvBuffer + recvBufferSize - 1;
-volatile char* inp = (char*)recvBuffer;
+uint recvTail = 0;										// next byte to parse, DMA writes at the head
+uint recvEnd = 0;										// end of the frame being parsed
+uint recvParsed = 0;									// bytes parsed since reset, recvTail unmasked
+volatile uint recvWraps = 0;							// DMA laps of the ring, see usartRecvWrapped()
 volatile char* outp;
 
-volatile bool usartDmaSendRequested;
+static_assert((recvBufferSize & recvMask) == 0, "recvBufferSize must be a power of two");
+
 volatile bool usartDmaSendBusy;
 volatile int usartTorqueCommandValue;
 volatile bool usartCommandReceived;
 
 const int COMMAND_TORQUE = 1;
 
+// Binary protocol: sync, address, opcode, length, payload, CRC-16 of address..payload.
+// Opcodes are the ASCII command letters, payloads their arguments as raw bytes. Replies
+// use their own sync byte and carry the sender in the address field; nodes skip them
+// whole, so their payloads are never searched for a request. 'T' is streamed and never
+// answered, like 't'.
+
+const uint8_t frameSyncRequest = 0xA5;
+const uint8_t frameSyncReply = 0x5A;
+const uint8_t frameError = 0x80;						// reply opcode flag: command failed
+const int frameHeader = 4;								// sync, address, opcode, length
+const int frameOverhead = frameHeader + 2;
+
+bool usartBinary = false;								// switched per bus with 'K', not persistent
+int usartModeRequest = -1;								// applied once the reply is queued
+bool frameBroadcast;
+uint8_t frameOpcode;
+int frameRemaining;										// payload bytes not yet read
+
+// Baud rate: 'B' picks a table entry, applied baudSwitchDelay after the command so every
+// node on the bus switches together once the master stops talking. Until a well formed
+// frame arrives at the new rate the node falls back to 115200 after baudFallbackDelay.
+
+const uint32_t baudRates[] = { 115200, 230400, 460800, 921600, 1000000, 2000000, 3000000, 4000000, 6000000 };
+const int baudCount = sizeof(baudRates) / sizeof(baudRates[0]);
+const int baudSwitchDelay = 10;
+const int baudFallbackDelay = 1000;
+
+int baudIndex = 0;										// not persistent, a reset always starts at 115200
+int baudRequest = -1;
+unsigned int baudSwitchTime;
+bool baudConfirmed = true;
+
+// Slotted replies: a reply to a broadcast request leaves replyTurnaround + (id - 1) slots
+// after the request ended, so the nodes answer back to back instead of all at once. TIM14
+// runs free in 2 us ticks; the idle line interrupt timestamps each burst, and a compare
+// on the same timer starts the transmit DMA. Waits are limited to one timer wrap, 131 ms.
+// A slot fits the longest reply the request's opcode can get, error included, so it is
+// the same on every node whatever each one answers. A broadcast line carries one command:
+// the rest of it is ignored, a second reply would have no slot.
+
+const int replyTurnaround = 50;							// ticks every node has to parse the request
+const unsigned int replyMaxAge = 100;					// gTickCount ticks after the request, later replies go out at once
+const int recvEventCount = 4;							// frame ends remembered, replies of other nodes add more
+
+volatile uint16_t recvEventHead[recvEventCount];		// DMA head when the line ended
+volatile uint16_t recvEventTime[recvEventCount];
+volatile unsigned int recvEventTick[recvEventCount];	// the same in gTickCount, TIM14 alone wraps every 131 ms
+volatile uint recvEventNext = 0;
+uint16_t frameEndTime;
+unsigned int frameEndTick;
+uint32_t frameSlotBytes;								// reply slot of the broadcast being parsed, 0 = not sized yet
+
 extern "C"
-void DMA1_Channel2_3_IRQHandler(){
-	if (DMA1->ISR & DMA_ISR_TCIF2)				// transfer complete on channel 2
+void DMA1_Channel4_5_IRQHandler(){
+	if (DMA1->ISR & DMA_ISR_TCIF4)				// transfer complete on channel 4
 	{
-		DMA1->IFCR |= DMA_IFCR_CTCIF2;			// clear "transfer complete" flag of channel 2
-		DMA1_Channel2->CCR &= ~DMA_CCR_EN;		// disable channel 2
+		DMA1->IFCR |= DMA_IFCR_CTCIF4;			// clear "transfer complete" flag of channel 4
+		DMA1_Channel4->CCR &= ~DMA_CCR_EN;		// disable channel 4
 		//USART1->CR1 |= USART_CR1_RE;			// enable receiver TODO: not needed once RE connected to DE
 		usartDmaSendBusy = false;
 	}
 }
 
+extern "C"
+void TIM14_IRQHandler(void) {
+	if (TIM14->SR & TIM_SR_CC1IF)
+	{
+		TIM14->SR = ~TIM_SR_CC1IF;				// rc_w0: writing 1 leaves the other flags alone
+		TIM14->DIER &= ~TIM_DIER_CC1IE;			// one reply per compare
+		DMA1_Channel4->CCR |= DMA_CCR_EN;		// our slot has come, start sending
+	}
+}
+
+// Channel 3 transfer complete: the DMA wrapped to the start of the ring. Shares its
+// interrupt with the SPI channel, see DMA1_Channel2_3_IRQHandler().
+
+void usartRecvWrapped() {
+	recvWraps++;
+}
+
+void recvLogEvent() {
+	uint k = recvEventNext;
+	recvEventHead[k] = (recvBufferSize - DMA1_Channel3->CNDTR) & (recvBufferSize - 1);
+	recvEventTime[k] = TIM14->CNT;
+	recvEventTick[k] = gTickCount;
+	recvEventNext = (k + 1) % recvEventCount;
+}
+
 extern "C"
 void USART1_IRQHandler(void) {
-	if (USART1->ISR & USART_ISR_CMF)
+	if (USART1->ISR & USART_ISR_IDLE)
 	{
-		USART1->ICR |= USART_ICR_CMCF;			// clear CMF flag bit
+		USART1->ICR |= USART_ICR_IDLECF;		// end of a burst, binary frames can contain '\n'
 		//USART1->CR1 &= ~USART_CR1_RE;			// disable receiver TODO: not needed once RE connected to DE
+		recvLogEvent();
 		usartCommandReceived = true;
 	}
 }
 
+void usartWriteBaud(uint32_t baud) {
+	if (48000000U / baud < 16)								// 16x oversampling tops out at 3 Mbaud
+	{
+		uint32_t div = (2 * 48000000U + baud / 2U) / baud;
+		USART1->CR1 |= USART_CR1_OVER8;
+		USART1->BRR = (div & ~0x0FU) | ((div & 0x0FU) >> 1);	// fraction is 3 bits with 8x oversampling
+	}
+	else
+	{
+		USART1->CR1 &= ~USART_CR1_OVER8;
+		USART1->BRR = (48000000U + baud / 2U) / baud;
+	}
+}
+void usartSetBaud(int index) {
+	while (usartDmaSendBusy) {}
+	while ((USART1->ISR & USART_ISR_TC) == 0) {}			// let the last reply out
+	
+	USART1->CR1 &= ~USART_CR1_UE;							// BRR and OVER8 are only writable while disabled
+	usartWriteBaud(baudRates[index]);
+	USART1->CR1 |= USART_CR1_UE;
+	
+	while ((USART1->ISR & USART_ISR_TEACK) == 0) {}
+	while ((USART1->ISR & USART_ISR_REACK) == 0) {}
+	
+	baudIndex = index;
+}
+void usartUpdateBaud() {
+	if (baudRequest >= 0 && (int)(gTickCount - baudSwitchTime) >= 0)
+	{
+		usartSetBaud(baudRequest);
+		baudRequest = -1;
+		baudConfirmed = baudIndex == 0;
+	}
+	
+	if (!baudConfirmed && (int)(gTickCount - baudSwitchTime) > baudFallbackDelay)
+	{
+		usartSetBaud(0);									// master lost, go back to where it starts
+		baudConfirmed = true;
+	}
+}
+
+
 void initUsart() {
-	usartDmaSendRequested = false;
 	usartTorqueCommandValue = 0;
 	usartDmaSendBusy = false;
 	
@@ -57,10 +180,8 @@ void initUsart() {
 
 	// config USART
 		
-	int baud = 115200;
-	
-	//USART1->BRR = (8000000U + baud / 2U) / baud;			// baud rate (should be 0x45)
-	USART1->BRR = (48000000U + baud / 2U) / baud;			// baud rate (should be 0x1A1)
+	//USART1->BRR = (8000000U + 115200 / 2U) / 115200;		// baud rate (should be 0x45)
+	usartWriteBaud(baudRates[0]);							// baud rate (should be 0x1A1), 'B' changes it
 	
 	CLEAR_BIT(USART1->CR2, (USART_CR2_LINEN | USART_CR2_CLKEN));
 	CLEAR_BIT(USART1->CR3, (USART_CR3_SCEN | USART_CR3_HDSEL | USART_CR3_IREN));
@@ -71,9 +192,7 @@ void initUsart() {
 	
 	USART1->CR1 |= USART_CR1_TE |							// enable transmitter
 		           USART_CR1_RE |							// enable receiver
-		           USART_CR1_CMIE;							// char match interrupt enable
-	
-	USART1->CR2 |= ('\n' << USART_CR2_ADD_Pos);				// stop char is '\n'
+		           USART_CR1_IDLEIE;						// idle line interrupt, the reference for reply slots
 	
 	// config A-1 pin as DE (manual)
 
@@ -103,13 +222,16 @@ void initUsart() {
 	// config DMA
 	
 	RCC->AHBENR |= RCC_AHBENR_DMA1EN;						// enable clock for DMA
+	RCC->APB2ENR |= RCC_APB2ENR_SYSCFGCOMPEN;				// enable clock for SYSCFG
+	
+	SYSCFG->CFGR1 |= SYSCFG_CFGR1_USART1TX_DMA_RMP;			// USART1 TX on channel 4, channel 2 is SPI1 RX
 	
-	// transmit channel 2
+	// transmit channel 4
 
-	DMA1_Channel2->CPAR = (uint32_t)(&(USART1->TDR));		// USART TDR is destination
-	DMA1_Channel2->CMAR = (uint32_t)(sendBuffer);			// source
+	DMA1_Channel4->CPAR = (uint32_t)(&(USART1->TDR));		// USART TDR is destination
+	DMA1_Channel4->CMAR = (uint32_t)(sendBuffer);			// source
 	
-	DMA1_Channel2->CCR |= DMA_CCR_MINC |					// increment memory
+	DMA1_Channel4->CCR |= DMA_CCR_MINC |					// increment memory
 		                  DMA_CCR_DIR |						// memory to peripheral
 		                  DMA_CCR_TCIE |					// interrupt on full transfer
 						  (0b10 << DMA_CCR_PL_Pos);			// priority = high
@@ -122,15 +244,76 @@ void initUsart() {
 	
 	DMA1_Channel3->CCR |= DMA_CCR_MINC |					// increment memory
 						  DMA_CCR_CIRC |					// circular mode
+						  DMA_CCR_TCIE |					// count the laps, see recvWritten()
 					      DMA_CCR_EN |						// enable DMA
 					      (0b10 << DMA_CCR_PL_Pos);			// priority = high
 	
 	//
 	
-	HAL_NVIC_SetPriority(DMA1_Channel2_3_IRQn, 0, 0);
-	HAL_NVIC_EnableIRQ(DMA1_Channel2_3_IRQn);
+	HAL_NVIC_SetPriority(DMA1_Channel4_5_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(DMA1_Channel4_5_IRQn);
+	
+	// reply slot timer 14
+	
+	RCC->APB1ENR |= RCC_APB1ENR_TIM14EN;					// enable timer 14
+	
+	TIM14->PSC = 95;										// 2 us ticks
+	TIM14->ARR = 0xFFFF;									// free running
+	TIM14->EGR |= TIM_EGR_UG;								// load the prescaler
+	TIM14->CR1 |= TIM_CR1_CEN;
+	
+	NVIC_SetPriority(TIM14_IRQn, 0);
+	NVIC_EnableIRQ(TIM14_IRQn);
+}
+void beginReply();
+void endReply();
+
+int replySlotTicks(uint32_t count) {
+	if (config->replySlot != 0xFFFF) return config->replySlot;
+	
+	uint32_t bits = (count + 1) * 10;							// plus a spare character
+	return (bits * 500000U + baudRates[baudIndex] - 1) / baudRates[baudIndex] + 1;
+}
+void usartStartSend(uint32_t count) {
+	DMA1_Channel4->CNDTR = count;								// transmit size	
+	usartDmaSendBusy = true;
+	
+	if (frameBroadcast)
+	{
+		uint32_t wait = replyTurnaround + (config->controllerId - 1) * replySlotTicks(frameSlotBytes);
+		
+		__disable_irq();
+		if (wait <= 0xFFFF && gTickCount - frameEndTick <= replyMaxAge &&
+			(uint16_t)(TIM14->CNT - frameEndTime) < wait)
+		{
+			TIM14->SR = ~TIM_SR_CC1IF;							// clear first, a match from here on is kept
+			TIM14->CCR1 = (uint16_t)(frameEndTime + wait);
+			TIM14->DIER |= TIM_DIER_CC1IE;						// TIM14_IRQHandler starts the DMA
+			
+			if ((uint16_t)(TIM14->CNT - frameEndTime) < wait)
+			{
+				__enable_irq();
+				return;
+			}
+			TIM14->DIER &= ~TIM_DIER_CC1IE;						// the slot came while arming, maybe before CCR1 held it
+			TIM14->SR = ~TIM_SR_CC1IF;
+		}
+		__enable_irq();											// slot already passed: late beats never
+	}
+	
+	DMA1_Channel4->CCR |= DMA_CCR_EN;							// enable DMA channel 4
 }
 void usartSendError(){
+	while (usartDmaSendBusy) {}									// pipelined requests, previous reply still going out
+	
+	if (usartBinary)
+	{
+		frameOpcode |= frameError;
+		beginReply();
+		endReply();
+		return;
+	}
+	
 	sendBuffer[0] = 'e';
 	sendBuffer[1] = 'r';
 	sendBuffer[2] = 'r';
@@ -139,51 +322,78 @@ void usartSendError(){
 	sendBuffer[5] = '\r';
 	sendBuffer[6] = '\n';
 
-	DMA1_Channel2->CNDTR = 7;									// buffer size	
-	DMA1_Channel2->CCR |= DMA_CCR_EN;							// enable DMA channel 2
-	usartDmaSendBusy = true;	
+	usartStartSend(7);
 }
 void usartSendOk() {
+	while (usartDmaSendBusy) {}
+	
+	if (usartBinary)
+	{
+		beginReply();
+		endReply();
+		return;
+	}
+	
 	sendBuffer[0] = 'O';
 	sendBuffer[1] = 'K';
 	sendBuffer[2] = '\r';
 	sendBuffer[3] = '\n';
 
-	DMA1_Channel2->CNDTR = 4;									// buffer size	
-	DMA1_Channel2->CCR |= DMA_CCR_EN;							// enable DMA channel 2
-	usartDmaSendBusy = true;	
+	usartStartSend(4);
 }
-bool readByte(uint8_t* output) {
-	uint8_t b1;
-	uint8_t b2;
+uint8_t recvPeek(int offset) {
+	return recvBuffer[(recvTail + offset) & recvMask];
+}
+char recvGet() {
+	if (recvTail == recvEnd) return '\n';						// never read past the frame
 	
+	char c = recvBuffer[recvTail];
+	recvTail = (recvTail + 1) & recvMask;
+	return c;
+}
+int hexDigit(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'A' && c <= 'F') return c - '7';
+	if (c >= 'a' && c <= 'f') return c - 'W';
+	return -1;
+}
+int recvHexDigit() {
+	if (recvTail == recvEnd) return -1;
+	return hexDigit(recvPeek(0));								// not consumed, a non-digit stays for the caller
+}
+bool readByte(uint8_t* output) {
 	*output = 0;
 	
-	if (*inp >= '0' && *inp <= '9') b1 = *inp - '0';
-	else if (*inp >= 'A' && *inp <= 'F') b1 = *inp - '7';
-	else if (*inp >= 'a' && *inp <= 'f') b1 = *inp - 'W';
-	else return false;
-	
-	inp++;
-	if (inp > recvBufferEnd) inp = (char*)recvBuffer;
+	if (usartBinary)
+	{
+		if (frameRemaining <= 0) return false;
+		frameRemaining--;
 		
-	if (*inp >= '0' && *inp <= '9') b2 = *inp - '0';
-	else if (*inp >= 'A' && *inp <= 'F') b2 = *inp - '7';
-	else if (*inp >= 'a' && *inp <= 'f') b2 = *inp - 'W';
-	else return false;
+		*output = recvGet();
+		return true;
+	}
+	
+	int b1 = recvHexDigit();
+	if (b1 < 0) return false;
+	recvGet();
 	
-	inp++;
-	if (inp > recvBufferEnd) inp = (char*)recvBuffer;
+	int b2 = recvHexDigit();
+	if (b2 < 0) return false;
+	recvGet();
 
 	*output = (b1 << 4) | b2;
 	return true;
 }
 void readChar(char* output){
-	*output = *inp;
-	inp++;
-	if (inp > recvBufferEnd) inp = (char*)recvBuffer;	
+	*output = recvGet();
 }
 bool writeByte(uint8_t byte) {
+	if (usartBinary)
+	{
+		*outp++ = byte;
+		return true;
+	}
+	
 	uint8_t b1 = (byte >> 4) & 0x0F;
 	uint8_t b2 = byte & 0x0F;
 	
@@ -192,12 +402,135 @@ bool writeByte(uint8_t byte) {
 	
 	if (b2 <= 9) *outp++ = '0' + b2;
 	else *outp++ = '7' + b2;	
+	return true;
+}
+void writeValue(uint32_t value, int bytes) {
+	for (int i = bytes - 1; i >= 0; i--)
+		writeByte((uint8_t)(value >> (i * 8)));				// most significant first
+}
+void beginReply() {
+	while (usartDmaSendBusy) {}
+	outp = (char*)sendBuffer;
+	
+	if (usartBinary)
+	{
+		*outp++ = frameSyncReply;
+		*outp++ = config->controllerId;							// id of the sender
+		*outp++ = frameOpcode;
+		*outp++ = 0;											// length, filled in by endReply()
+		return;
+	}
+	
+	writeByte(mainboardId);										// to main controller
+	writeByte(config->controllerId);							// id of the sender	
+}
+void endReply() {
+	if (usartBinary)
+	{
+		int length = outp - (char*)sendBuffer;
+		sendBuffer[3] = length - frameHeader;
+		
+		uint16_t crc = crc16((const void*)(sendBuffer + 1), length - 1);
+		*outp++ = crc >> 8;
+		*outp++ = crc;
+	}
+	else
+	{
+		*outp++ = '\r';
+		*outp++ = '\n';
+	}
+	
+	usartStartSend(outp - (char*)sendBuffer);
+}
+void usartSendPosition() {
+	int turns, angle;
+	spiGetPosition(&turns, &angle);
+	
+	beginReply();
+	writeValue(turns, 4);										// signed full revolutions
+	writeValue(angle, 2);										// 15-bit fraction
+	endReply();
+}
+void usartSendVelocity() {
+	beginReply();
+	writeValue(observerVelocity, 4);
+	writeValue(observerAcceleration, 4);
+	endReply();
+}
+void usartSendControlStats() {
+	beginReply();
+	writeValue(controlCycles, 4);
+	writeValue(controlOverruns, 2);
+	writeValue(controlMaxDelay, 2);
+	writeValue(controlMaxLatency, 2);
+	endReply();
+	
+	controlMaxDelay = 0;										// worst-case values restart with each read
+	controlMaxLatency = 0;
+}
+void usartSendCalibrationReport() {
+	const CalibrationReport& r = calibReport;
+	
+	beginReply();
+	writeValue(r.duration, 2);
+	writeValue(r.status, 1);
+	writeValue(r.polePairs, 1);
+	writeValue(r.up, 1);
+	writeValue(r.minRange, 2);
+	writeValue(r.maxRange, 2);
+	writeValue(r.hysteresisMax, 2);
+	writeValue(r.hysteresisMean, 2);
+	for (int i = 0; i < calibReportSegments; i++)
+		writeValue(r.hysteresis[i], 1);
+	endReply();
+}
+
+const int calibReadChunk = 32;							// bytes per 'x' reply, fits sendBuffer
+const int calibWriteChunk = 16;							// bytes per 'W' command, fits recvBuffer
+
+bool usartSendCalibrationChunk() {
+	uint8_t hi, lo;
+	
+	if (!readByte(&hi) || !readByte(&lo)) return false;
+	
+	int offset = (hi << 8) | lo;
+	int count = sizeof(CalibrationData) - offset;
+	if (count <= 0) return false;
+	if (count > calibReadChunk) count = calibReadChunk;
+	
+	const uint8_t* block = (const uint8_t*)&config->calib;
+	
+	beginReply();
+	writeValue(offset, 2);
+	for (int i = 0; i < count; i++)
+		writeByte(block[offset + i]);
+	endReply();
+	return true;
+}
+void usartSendCalibrationCrc() {
+	beginReply();
+	writeValue(sizeof(CalibrationData), 2);
+	writeValue(crc16(&config->calib, sizeof(CalibrationData)), 2);
+	endReply();
 }
 
 bool processTorque(){
 	char sign;
 	uint8_t value;
 	
+	if (usartBinary)
+	{
+		uint8_t hi, lo;
+		
+		if (!readByte(&hi) || !readByte(&lo)) return false;
+		
+		int torque = (int16_t)((hi << 8) | lo);				// full resolution, +-sin_range
+		if (torque > sin_range || torque < -sin_range) return false;
+		
+		usartTorqueCommandValue = torque;
+		return true;
+	}
+	
 	readChar(&sign);
 	if (!readByte(&value)) return false;
 	
@@ -213,6 +546,26 @@ bool processTorque(){
 	
 	return true;	
 }
+
+// Torque for the whole bus in one frame, 't' addressed to broadcastId: one slot per
+// controller, slot = controllerId - 1. ASCII slots are signed hex bytes in units of
+// sin_range / 128, binary slots signed 16-bit in sin_range units. Never answered.
+
+void processTorqueSlots(){
+	int slot = config->controllerId - 1;
+	int width = usartBinary ? 2 : 1;
+	uint8_t hi, lo = 0;
+	
+	for (int i = 0; i < slot * width; i++)
+		if (!readByte(&hi)) return;							// bus shorter than our id
+	
+	if (slot < 0 || !readByte(&hi) || (usartBinary && !readByte(&lo))) return;
+	
+	int torque = usartBinary ? (int16_t)((hi << 8) | lo) : (int8_t)hi * (sin_range / 128);
+	if (torque <= sin_range && torque >= -sin_range) usartTorqueCommandValue = torque;
+	
+	while (readByte(&hi)) {}								// rest of the line belongs to other nodes
+}
 bool processIdentity() {
 	char sign;
 	uint8_t value;
@@ -229,98 +582,414 @@ bool processIdentity() {
 	
 	return true;	
 }
+bool processSpiConfig() {
+	uint8_t value;
+	
+	if (!readByte(&value)) return false;
+	
+	ConfigData lc;
+	memcpy(&lc, config, sizeof(ConfigData));
+	lc.spiPrescaler = value & 0x07;							// bits 0-2: prescaler
+	lc.spiPipelined = (value & 0x80) ? 1 : 0;				// bit 7: pipelined reads
+	
+	bool running = controlLoopRunning;
+	stopControlLoop();										// no transfer in flight while SPI is reconfigured
+	writeFlash((uint16_t*)&lc, sizeof(ConfigData) / sizeof(uint16_t));
+	spiApplyConfig();
+	if (running) startControlLoop();
+	
+	return true;
+}
+bool processObserverConfig() {
+	uint8_t value;
+	
+	if (!readByte(&value)) return false;
+	if (value < 2 || value > 12) return false;
+	
+	ConfigData lc;
+	memcpy(&lc, config, sizeof(ConfigData));
+	lc.observerShift = value;
+	
+	writeFlash((uint16_t*)&lc, sizeof(ConfigData) / sizeof(uint16_t));
+	observerShift = value;									// the observer picks it up from the next period
+	
+	return true;
+}
+bool processCommutationDelay() {
+	uint8_t b1, b2;
+	
+	if (!readByte(&b1) || !readByte(&b2)) return false;
+	
+	ConfigData lc;
+	memcpy(&lc, config, sizeof(ConfigData));
+	lc.commutationDelay = (b1 << 8) | b2;					// 1/256 control periods, FFFF = default
+	
+	writeFlash((uint16_t*)&lc, sizeof(ConfigData) / sizeof(uint16_t));
+	setCommutationDelay(lc.commutationDelay);
+	
+	return true;
+}
+bool processPwmMode() {
+	uint8_t value;
+	
+	if (!readByte(&value)) return false;
+	if (value != pwmModeSine && value != pwmModeMinMax) return false;
+	
+	setPwmMode(value);
+	return true;
+}
 bool processCalibrate(){
-	calibrate();
+	if (!calibrate()) return false;
 	blinkCalib(false);
 	return true;
 }
+bool processRezero(){
+	return rezero();
+}
+bool processCogging(){
+	return identifyCogging();
+}
+bool processTuneSensor(){
+	return tuneSensor();
+}
+bool processCalibrationWrite(){
+	uint8_t hi, lo;
+	uint8_t data[calibWriteChunk];
+	
+	if (!readByte(&hi) || !readByte(&lo)) return false;
+	
+	int count = 0;
+	while (count < calibWriteChunk && readByte(&data[count])) count++;
+	
+	return count > 0 && stageCalibration((hi << 8) | lo, data, count);
+}
+bool processProtocol(){
+	uint8_t value;
+	
+	if (!readByte(&value)) return false;
+	if (value > 1) return false;
+	
+	usartModeRequest = value;								// 0: ASCII hex, 1: binary frames
+	return true;
+}
+bool processBaud(){
+	uint8_t value;
+	
+	if (!readByte(&value)) return false;
+	if (value >= baudCount) return false;
+	
+	baudRequest = value;
+	baudSwitchTime = gTickCount + baudSwitchDelay;
+	return true;
+}
+bool processReplySlot(){
+	uint8_t b1, b2;
+	
+	if (!readByte(&b1) || !readByte(&b2)) return false;
+	
+	ConfigData lc;
+	memcpy(&lc, config, sizeof(ConfigData));
+	lc.replySlot = (b1 << 8) | b2;							// 2 us ticks, FFFF = reply length at the current baud
+	
+	writeFlash((uint16_t*)&lc, sizeof(ConfigData) / sizeof(uint16_t));
+	return true;
+}
+bool processCalibrationCommit(){
+	uint8_t hi, lo;
+	
+	if (!readByte(&hi) || !readByte(&lo)) return false;
+	
+	return importCalibration((hi << 8) | lo);
+}
 
-void processUsartCommand(){
-	uint8_t b1, b2, b3, b4;
-	bool success = true;
+bool processCommand(char cmd, bool* replied){
+	switch (cmd)
+	{
+	case 'T':
+		if (!usartBinary) return processTorque();
+		processTorque();									// binary: no reply, the master is already sending the next
+		*replied = true;
+		return true;
+	case 'I': return processIdentity();
+	case 'S': return processSpiConfig();
+	case 'O': return processObserverConfig();
+	case 'L': return processCommutationDelay();
+	case 'M': return processPwmMode();
+	case 'C': return processCalibrate();
+	case 'Z': return processRezero();
+	case 'U': return processTuneSensor();
+	case 'G': return processCogging();
+	case 'W': return processCalibrationWrite();
+	case 'Y': return processCalibrationCommit();
+	case 'Q': return processReplySlot();
+		
+	case 'K':
+		if (frameBroadcast) *replied = true;				// every node would answer at once
+		return processProtocol();
+		
+	case 'B':
+		if (frameBroadcast) *replied = true;
+		return processBaud();
+		
+	case 't':
+		processTorqueSlots();								// malformed frames are ignored, never answered
+		*replied = true;
+		return true;
+		
+	case 'a':
+		usartSendAngle();									// in order with the replies that follow
+		*replied = true;
+		return true;
+		
+	case 'p':
+		usartSendPosition();
+		*replied = true;
+		return true;
+		
+	case 'v':
+		usartSendVelocity();
+		*replied = true;
+		return true;
+		
+	case 'j':
+		usartSendControlStats();
+		*replied = true;
+		return true;
+		
+	case 'r':
+		usartSendCalibrationReport();
+		*replied = true;
+		return true;
+		
+	case 'x':
+		if (!usartSendCalibrationChunk()) return false;
+		*replied = true;
+		return true;
+		
+	case 'y':
+		usartSendCalibrationCrc();
+		*replied = true;
+		return true;
+		
+	default: return false;
+	}
+}
+
+// Longest reply to cmd on the wire: its data reply or an error, whichever is longer.
+
+uint32_t replyLength(uint8_t cmd) {
+	int payload = 0;
+	switch (cmd)
+	{
+	case 'a': payload = 2; break;
+	case 'p': payload = 6; break;
+	case 'v': payload = 8; break;
+	case 'j': payload = 10; break;
+	case 'r': payload = 13 + calibReportSegments; break;
+	case 'x': payload = 2 + calibReadChunk; break;
+	case 'y': payload = 4; break;
+	}
+	
+	if (usartBinary) return frameOverhead + payload;		// OK and error are empty frames
+	
+	int length = 6 + 2 * payload;							// ids, hex payload, line end
+	return length > 7 ? length : 7;							// "error\r\n"
+}
+
+uint16_t recvCrc(int offset, int count) {
+	int start = (recvTail + offset) & recvMask;
+	int first = recvBufferSize - start;						// the frame may wrap around the ring
+	
+	if (count <= first) return crc16((const void*)(recvBuffer + start), count);
+	return crc16((const void*)recvBuffer, count - first, crc16((const void*)(recvBuffer + start), first));
+}
+
+// Time the line went idle after the frame ending at ring index end, newest first since
+// the ring laps. Without one the frame did not end its burst, use now.
+
+void recvFrameEnd(uint end) {
+	for (int i = 1; i <= recvEventCount; i++)
+	{
+		uint k = (recvEventNext + recvEventCount - i) % recvEventCount;
+		if (recvEventHead[k] == end)
+		{
+			frameEndTime = recvEventTime[k];
+			frameEndTick = recvEventTick[k];
+			return;
+		}
+	}
 	
-	// skip noice. todo: why!?
-	if (*inp >= '0' && *inp <= '9' || *inp >= 'A' && *inp <= 'F' || *inp >= 'a' && *inp <= 'f') {}
-	else 
+	frameEndTime = TIM14->CNT;
+	frameEndTick = gTickCount;
+}
+
+// Bytes the DMA has written since reset. A lap whose interrupt is still pending is
+// counted here, the flag is read on both sides of the head so the two agree.
+
+uint recvWritten() {
+	uint pending, head;
+	
+	__disable_irq();
+	do
 	{
-		inp++;
-		if (inp > recvBufferEnd) inp = (char*)recvBuffer;
+		pending = DMA1->ISR & DMA_ISR_TCIF3;
+		head = (recvBufferSize - DMA1_Channel3->CNDTR) & recvMask;
 	}
+	while (pending != (DMA1->ISR & DMA_ISR_TCIF3));
+	uint written = (recvWraps + (pending ? 1 : 0)) * recvBufferSize + head;
+	__enable_irq();
+	
+	return written;
+}
+
+// While a blocking command ('C', 'G', 'U', the buttons) keeps the main loop away, the
+// DMA can lap bytes not parsed yet. They are overwritten, whatever is left is dropped.
+
+bool recvLapped() {
+	return recvWritten() - recvParsed > recvMask;
+}
+
+// Frame parsers work on the ring in place between recvTail and the DMA head. They
+// return how many bytes they used up, 0 when the frame is still incomplete; *handled
+// tells whether it was a request for this node, *success and *replied how it went.
+
+int parseBinaryFrame(uint available, bool* handled, bool* success, bool* replied){
+	uint8_t sync = recvPeek(0);
+	if (sync != frameSyncRequest && sync != frameSyncReply) return 1;	// resynchronize byte by byte
+	if (available < frameOverhead) return 0;
+	
+	uint8_t address = recvPeek(1);
+	int length = recvPeek(3);
+	if (length > recvMask - frameOverhead) return 1;		// could never fit the ring
+	if (available < frameOverhead + length) return 0;
+	
+	uint16_t crc = (recvPeek(frameHeader + length) << 8) | recvPeek(frameHeader + length + 1);
+	if (recvCrc(1, frameHeader - 1 + length) != crc) return 1;	// damaged, or a sync byte inside data
+	
+	if (sync == frameSyncReply) return frameOverhead + length;	// another node's reply, skipped whole
+	
+	baudConfirmed = true;									// the master talks at our rate
+	if (address != config->controllerId && address != broadcastId) return frameOverhead + length;
+	
+	uint start = recvTail;
+	frameBroadcast = address == broadcastId;
+	recvFrameEnd((start + frameOverhead + length) & recvMask);
+	frameOpcode = recvPeek(2);
+	frameSlotBytes = replyLength(frameOpcode);
+	frameRemaining = length;
+	recvTail = (recvTail + frameHeader) & recvMask;
+	recvEnd = (recvTail + length) & recvMask;
+	
+	*handled = true;
+	*success = processCommand(frameOpcode, replied);
+	
+	recvTail = start;
+	return frameOverhead + length;
+}
+int parseAsciiLine(uint available, bool* handled, bool* success, bool* replied){
+	uint length = 0;
+	while (length < available && recvPeek(length) != '\n') length++;
+	if (length == available)
+		return available == recvMask ? available : 0;		// ring full without a line end: drop it
+	length++;
+	
+	uint start = recvTail;
+	recvEnd = (recvTail + length) & recvMask;
 	
-	if (readByte(&b1) && (b1 == config->controllerId || b1 == broadcastId))
+	while (recvTail != recvEnd && recvHexDigit() < 0) recvGet();	// line noise, e.g. a glitch as DE toggles
+	
+	uint8_t b1;
+	if (readByte(&b1))
 	{
-		// message addressed to this controller
+		baudConfirmed = true;								// the master talks at our rate
 		
-		char cmd;
-		while (true)
+		if (b1 == config->controllerId || b1 == broadcastId)
 		{
-			readChar(&cmd);
+			// message addressed to this controller
+			
+			frameBroadcast = b1 == broadcastId;
+			recvFrameEnd(recvEnd);
+			frameSlotBytes = 0;
+			*handled = true;
 			
-			switch (cmd)
+			char cmd;
+			while (true)
 			{
-			case '\r':
-			case '\n': goto _done;
+				readChar(&cmd);
+				if (cmd == '\r' || cmd == '\n') break;
 				
-			case 'T': if (!processTorque())
+				if (frameBroadcast)
 				{
-					success = false;
-					goto _done;
+					if (frameSlotBytes) break;						// one command per broadcast line
+					frameSlotBytes = replyLength(cmd);
 				}
-				break;
-
-			case 'I': if (!processIdentity())
-				{
-					success = false;
-					goto _done;
-				}
-				break;
 				
-			case 'C': if (!processCalibrate())
+				if (!processCommand(cmd, replied))
 				{
-					success = false;
-					goto _done;
+					*success = false;
+					break;
 				}
-				break;
-				
-			case 'a':
-				usartDmaSendRequested = true;
-				break;
-				
-			default:
+				if (recvLapped())								// the rest of the line is gone
 				{
-					success = false;
-					goto _done;
-				}				
+					*success = false;
+					break;
+				}
 			}
 		}
-		
-_done:
-		if (success) {
-			if (!usartDmaSendRequested) usartSendOk();
-		}
-		else usartSendError();
 	}
-	else
+	
+	recvTail = start;
+	return length;
+}
+
+// Runs on every idle line: parses all complete frames in the ring, so requests
+// sent back to back are all answered, each reply after the previous one went out.
+
+void processUsartCommand(){
+	while (true)
 	{
-		//USART1->CR1 |= USART_CR1_RE;			// enable receiver TODO: not needed once RE connected to DE
+		uint written = recvWritten();
+		if (written - recvParsed > recvMask)
+		{
+			recvTail = written & recvMask;					// lapped, drop the ring
+			recvParsed = written;
+			break;
+		}
+		
+		uint available = written - recvParsed;
+		if (available == 0) break;
+		
+		bool handled = false;
+		bool success = true;
+		bool replied = false;
+		
+		int used = usartBinary ? parseBinaryFrame(available, &handled, &success, &replied)
+		                       : parseAsciiLine(available, &handled, &success, &replied);
+		if (used == 0) break;								// rest arrives with the next idle line
+		recvTail = (recvTail + used) & recvMask;
+		recvParsed += used;
+		
+		if (handled)
+		{
+			if (!success) usartSendError();
+			else if (!replied) usartSendOk();
+		}
+		frameBroadcast = false;								// main loop replies are never slotted
+		
+		if (usartModeRequest >= 0)
+		{
+			usartBinary = usartModeRequest;					// the reply above was encoded in the old mode
+			usartModeRequest = -1;
+		}
 	}
-	
-	uint bufferPosition = recvBufferSize - DMA1_Channel3->CNDTR;
-	inp = (char*)recvBuffer + bufferPosition;
 }
 
 void usartSendAngle() {
-	outp = (char*)sendBuffer;
-	writeByte(0);												// to main controller
-	writeByte(config->controllerId);							// id of the sender	
-	writeByte((uint8_t)((spiCurrentAngle >> 8) & (uint8_t)0x00FFU));
-	writeByte((uint8_t)(spiCurrentAngle & (uint8_t)0x00FFU));
-	*outp++ = '\r';
-	*outp++ = '\n';
+	int angle = spiCurrentAngle;								// updated by the control loop
 	
-	uint32_t cnt = outp - (char*)sendBuffer;
-
-	DMA1_Channel2->CNDTR = cnt;									// transmit size	
-	DMA1_Channel2->CCR |= DMA_CCR_EN;							// enable DMA channel 2
-	usartDmaSendBusy = true;
+	frameOpcode = 'a';
+	beginReply();
+	writeByte((uint8_t)((angle >> 8) & (uint8_t)0x00FFU));
+	writeByte((uint8_t)(angle & (uint8_t)0x00FFU));
+	endReply();
 }
\ No newline at end of file
@@ -1,6 +1,9 @@
 #include <main.h>
 
 void writeFlash(uint16_t* data, int count) {
+	bool running = controlLoopRunning;								// the erased page reads 0xFFFF, keep the loop off it
+	if (running) stopControlLoop();
+	
 	// unlock
 	
 	while ((FLASH->SR & FLASH_SR_BSY) != 0) {}						// wait for flash not busy
@@ -48,6 +51,21 @@ void writeFlash(uint16_t* data, int count) {
 	}
 	
 	FLASH->CR &= ~FLASH_CR_PG;										// disable programming
+	
+	if (running) startControlLoop();								// callers that stopped it themselves restart it
+}
+
+uint16_t crc16(const void* data, int count, uint16_t crc)
+{
+	const uint8_t* p = (const uint8_t*)data;
+	
+	for (int i = 0; i < count; i++)
+	{
+		crc ^= p[i] << 8;
+		for (int b = 0; b < 8; b++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;	// CCITT polynomial, no table to keep flash
+	}
+	return crc;
 }
 
 void memcpy(void *dst, const void *src, int count)
@@ -1,7 +1,7 @@
 #include <main.h>
 
 int ensureConfigured() {
-	bool calibConfigured = config->calibrated;
+	bool calibConfigured = config->calib.calibrated;
 	bool idConfigured = config->controllerId != 0 && config->controllerId != -1;
 	
 	if (!calibConfigured) blinkCalib(true);
@@ -14,8 +14,9 @@ int main(void) {
 	initClockExternal();
 	initButtons();
 	initUsart();
+	initCalibration();
+	initSysTick();							// sensor register writes wait for NVM
 	initSpi();
-	initSysTick();
 	//delay(100);
 	initPwm();
 	
@@ -26,26 +27,29 @@ int main(void) {
 	
 	//usartTorqueCommandValue = -250;	
 	
-	usartDmaSendRequested = false;
 	buttonIdPressed = false;
 	buttonCalibPressed = false;
+	
+	startControlLoop();
 
 	while (true){
+#ifndef CONTROL_IN_TIMER
 		spiReadAngleFiltered();
 		setPwmTorque();
+#endif
 		
-		if (usartDmaSendRequested && !usartDmaSendBusy)
-		{
-			usartSendAngle();
-			usartDmaSendRequested = false;
-		}
+#ifdef CALIB_REFINE
+		calibRefine();
+#endif
 		
 		if (usartCommandReceived)
 		{
+			usartCommandReceived = false;				// cleared first, a frame landing meanwhile raises it again
 			processUsartCommand();
-			usartCommandReceived = false;
 		}
 		
+		usartUpdateBaud();
+		
 		if (buttonIdPressed)
 		{
 			incrementIdAndSave();
@@ -54,10 +58,10 @@ int main(void) {
 		
 		if (buttonCalibPressed)
 		{
-			calibrate(); 
+			if (buttonCalibLongPress()) rezero();
+			else if (calibrate()) blinkCalib(false);
 			buttonCalibPressed = false;
 			usartTorqueCommandValue = 0;
-			usartDmaSendRequested = false;
 		}
 	}
 }
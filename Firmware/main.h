@@ -7,23 +7,41 @@
 #define POSITIVE_MODULO(A, B)	((A % B + B) %B)
 
 const unsigned int flashPageAddress = 0x08007800;
-const int numQuadrants = 32;
+const unsigned int flashPageSize = 1024;
 
-struct QuadrantData
+const int calibTableBits = 8;
+const int calibTableSize = 1 << calibTableBits;		// one entry per 128 sensor counts
+const int calibHarmonics = 3;							// sensor error harmonics per revolution fitted by calibrate()
+const int cogBinBits = 7;
+const int cogBins = 1 << cogBinBits;					// cogging torque points per electric revolution
+const int cogUnit = 32;									// torque command per cogging table count
+
+struct CalibrationData							// everything calibrate() and identifyCogging() learn about a motor
 {
-	unsigned int maxAngle;
-	unsigned int minAngle;
-	unsigned int range;
+	int16_t table[calibTableSize] = { 0 };		// electric angle (mod sin_period) at each corrected sensor bin boundary
+	int16_t harmonics[calibHarmonics][2] = { 0 };	// sensor error per revolution harmonic, cos and sin, sensor counts Q4
+	bool up = false;
+	bool calibrated = false;
+	uint8_t polePairs = 0;			// electric revolutions per mechanical one, detected by calibrate()
+	uint8_t cogCompensation = 0;	// 1: cogging table below is valid and fed forward
+	int8_t cogging[cogBins] = { 0 };	// torque holding the rotor at each electric angle, cogUnit
 };
 
 struct ConfigData
 {
 	int controllerId = 0;
-	QuadrantData quadrants[numQuadrants] = { 0 };
-	bool up = false;
-	bool calibrated = false;
+	CalibrationData calib;			// read and written over the bus as one block, see importCalibration()
+	uint8_t spiPrescaler = 3;		// SPI clock = PCLK / 2^(n+1), 0..7
+	uint8_t spiPipelined = 0;		// 1: free-running loop reads the angle started on the previous pass
+	uint8_t observerShift = 5;		// tracking bandwidth 2^-n rad per control period, 2..12
+	uint16_t commutationDelay = 0xFFFF;	// sample to mid-PWM delay, 1/256 control periods, 0xFFFF = default
+	uint8_t spiBct = 160;			// MA700 linearity correction strength, chosen by tuneSensor()
+	uint8_t spiAxis = 1 << 5;		// MA700 correction axis, spiAxisX or spiAxisY
+	uint16_t replySlot = 0xFFFF;	// broadcast reply slot, 2 us ticks, 0xFFFF = reply length at the current baud
+	uint8_t tuneRuns = 0xFF;		// tuneSensor() runs so far, 0xFF = none, each costs MA700 NVM writes
 };
 
+static_assert(sizeof(ConfigData) <= flashPageSize, "ConfigData must fit the flash page");
 
 extern ConfigData* config;
 
@@ -40,15 +58,70 @@ void delay(int ms);
 
 #define sin_period		(1 << 15)		// 32K or 0x8000
 #define sin_range		(1 << 13)		//  8K or 0x2000
+#define sin_mask		(sin_period - 1)
+
+#define CONTROL_IN_TIMER					// sensor sampled on TIM1 update, commutation runs when it lands
+
+extern volatile unsigned int controlCycles;
+extern volatile unsigned int controlOverruns;
+extern volatile int controlMaxDelay;
+extern volatile int controlMaxLatency;
+
+const int pwmModeSine = 0;
+const int pwmModeMinMax = 1;			// space-vector equivalent, ~15% more fundamental voltage
 
 void initPwm();
 void setPwm(int angle, int power);
+int isin_table(int x);
+void setPwmMode(int mode);
 void setPwmTorque();
+void setCommutationDelay(int delay);
+void controlPeriod();
+extern bool controlLoopRunning;
+void startControlLoop();
+void stopControlLoop();
 
 // calibrate ------------------------------------------------------------------
 
-void calibrate();
-int getElectricDegrees();
+const uint8_t calibStatusNone = 0;
+const uint8_t calibStatusOk = 1;
+const uint8_t calibStatusTimeout = 2;			// ran out of calibBudget
+const uint8_t calibStatusBadPoles = 3;			// pole pairs outside 1..maxPoles, e.g. rotor blocked
+
+const int calibReportSegments = 16;				// hysteresis is summarized per 1/16 revolution
+
+struct CalibrationReport
+{
+	uint16_t duration;							// ticks
+	uint8_t status;
+	uint8_t polePairs;
+	bool up;
+	uint16_t minRange;							// electric counts per table bin
+	uint16_t maxRange;
+	uint16_t hysteresisMax;						// electric counts between the forward and backward sweeps
+	uint16_t hysteresisMean;
+	uint8_t hysteresis[calibReportSegments];	// worst per segment, electric counts / 16, saturated
+};
+
+extern CalibrationReport calibReport;
+
+//#define CALIB_REFINE						// keep refining the sensor eccentricity fit while running, only for loads even over a revolution
+
+void initCalibration();
+int correctSensor(int angle);
+void calibRefineSample(int angle);		// control loop, corrected angle
+void calibRefine();						// main loop
+
+extern bool coggingActive;
+int cogFeedForward(int electricAngle);
+bool identifyCogging();					// blocking, rotor must be free; false: not calibrated
+
+bool stageCalibration(int offset, const uint8_t* data, int count);
+bool importCalibration(uint16_t crc);	// false: CRC mismatch or implausible block, flash untouched
+bool calibrate();						// false: ran out of time, previous calibration kept
+bool rezero();							// shift the table to a new electric offset, under a second; false: flash untouched
+bool tuneSensor();						// pick the MA700 BCT and axis, then recalibrate; false past tuneMaxRuns
+int getElectricDegrees(int angle);
 	
 // buttons --------------------------------------------------------------------
 
@@ -60,31 +133,47 @@ void initButtons();
 void blinkId(bool onOff);
 void blinkCalib(bool onOff);
 void incrementIdAndSave();
-
+bool buttonCalibLongPress();
 // spi ------------------------------------------------------------------------
 
 #define SENSOR_MAX sin_period	// 32K
 
-extern int spiCurrentAngle;
+extern volatile int spiCurrentAngle;
+extern volatile int spiTurns;
+extern volatile int observerVelocity;		// 2^-17 sensor counts per control period
+extern volatile int observerAcceleration;	// 2^-17 sensor counts per control period^2
+extern int observerShift;
 
 void initSpi();
 int spiReadAngle();
 void spiReadAngleFiltered();
+void spiUpdateAngle(int a);
+void spiGetPosition(int* turns, int* angle);
+void spiStartDma();
+void spiStopDma();
+void spiApplyConfig();
+
+const uint8_t spiAxisX = 1 << 4;
+const uint8_t spiAxisY = 1 << 5;
+
+void spiSetCorrection(int bct, int axis);	// writes MA700 NVM only when the value changes
 
 // usart ----------------------------------------------------------------------
 
 extern volatile int usartTorqueCommandValue;
-extern volatile bool usartDmaSendRequested;
 extern volatile bool usartDmaSendBusy;
 extern volatile bool usartCommandReceived;
 
 void initUsart();
+void usartUpdateBaud();					// main loop, applies 'B' and its fallback
 void usartSendAngle();
 void processUsartCommand();
+void usartRecvWrapped();				// DMA channel 3 interrupt
 
 // flash ----------------------------------------------------------------------
 
 void writeFlash(uint16_t* data, int count);
 void memcpy(void *dst, const void *src, int count);
+uint16_t crc16(const void* data, int count, uint16_t crc = 0xFFFF);	// CRC-16/CCITT-FALSE
 
 #endif
\ No newline at end of file
@@ -0,0 +1,84 @@
+// setPwmTorque() on a rotor turning at a constant speed, with and without the commutation
+// advance: the duty computed from the sample of period n is applied from n+1 to n+2, and
+// the torque per amp is the share of the phase currents along the rotor's torque axis.
+// Resistive windings, so current follows the duty; inductance would only add more lag.
+// The advance has to raise torque per amp at speed and leave it alone at standstill.
+
+#include <main.h>
+#include <math.h>
+#include <stdio.h>
+
+extern volatile int spiCurrentAngle;
+extern volatile int observerVelocity;
+
+static double torquePerAmp(int speed, int delay, int torque) {
+	const int periods = 2000;
+	const int window = 8;						// rotor positions averaged while a duty is applied
+
+	setCommutationDelay(delay);
+	usartTorqueCommandValue = torque;
+
+	double sum = 0;
+	for (int n = 0; n < periods; n++)
+	{
+		double sample = 1234.0 + (double)speed * n;		// electric counts when period n is sampled
+		spiCurrentAngle = (int)lround(sample) & sin_mask;
+		observerVelocity = speed << 17;
+		setPwmTorque();
+
+		double d[3] = { (double)TIM1->CCR1, (double)TIM1->CCR2, (double)TIM1->CCR3 };
+		double mean = (d[0] + d[1] + d[2]) / 3;
+		double norm = 0;
+		for (int p = 0; p < 3; p++)
+		{
+			d[p] -= mean;						// the star point floats, common mode drives no current
+			norm += d[p] * d[p];
+		}
+		norm = sqrt(norm * 2 / 3);				// current vector length
+		if (norm == 0) continue;
+
+		for (int w = 0; w < window; w++)
+		{
+			double rotor = sample + speed * (1 + (w + 0.5) / window);	// during period n+1
+			double along = 0;
+			for (int p = 0; p < 3; p++)
+			{
+				double axis = 2 * M_PI * (rotor + sin_period / 4.0 + p * sin_period / 3.0) / sin_period;
+				along += d[p] * sin(axis);
+			}
+			sum += along * 2 / 3 / norm * (torque > 0 ? 1 : -1) / window;
+		}
+	}
+
+	usartTorqueCommandValue = 0;
+	return sum / periods;
+}
+
+int main() {
+	const int speeds[] = { 0, 100, -100, 300, -300, 600, -600, 1200, -1200 };	// electric counts per period
+	const int torques[] = { 2000, -2000 };
+	int failures = 0;
+
+	setPwmMode(pwmModeSine);
+
+	for (int speed : speeds)
+	{
+		for (int torque : torques)
+		{
+			double without = torquePerAmp(speed, 0, torque);
+			double with = torquePerAmp(speed, 0xFFFF, torque);
+
+			printf("speed %5d torque %5d: torque per amp %.4f without advance, %.4f with\n", speed, torque, without, with);
+			if (with < without - 0.001) failures++;				// never worse, standstill included
+			if (speed != 0 && with <= without) failures++;		// and better at speed
+			if (speed == 0 && with < 0.99) failures++;
+		}
+	}
+
+	if (failures)
+	{
+		printf("FAILED: %d cases\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,90 @@
+// identifyCogging() on the motor model with the control loop running: the table has to
+// match the model's cogging within a few table counts and the run has to end well inside
+// cogBudget. A rotor the loop cannot hold has to run into the budget and be refused with
+// the flash page and the compensation left as they were.
+
+#include "plant.h"
+#include <math.h>
+#include <stdio.h>
+
+const unsigned int budget = 45000;			// cogBudget
+const double maxTableError = 3.5 * cogUnit;	// rms, torque command units
+
+static double tableError() {
+	double sum = 0;
+	int bins = 0;
+
+	for (int b = 0; b < cogBins; b++)
+	{
+		for (int k = 0; k < 20000; k++)		// the first pole pair where this bin's angle is
+		{
+			double rotor = k / 20000.0 / plant.polePairs;
+			int s = (int)floor(plantSensor(rotor) * sin_period) & sin_mask;
+			int e = getElectricDegrees(correctSensor(s));
+			int d = ((e - (b << (15 - cogBinBits))) << 17) >> 17;
+			if (abs(d) > 8) continue;
+
+			double d2 = config->calib.cogging[b] * cogUnit - plantCogging(rotor);
+			sum += d2 * d2;
+			bins++;
+			break;
+		}
+	}
+	return bins ? sqrt(sum / bins) : 1e9;
+}
+
+int main() {
+	int failures = 0;
+
+	for (int up = 0; up < 2; up++)
+	{
+		Plant motor;
+		motor.up = up;
+		motor.eccentricity = 0.002;
+		motor.friction = 0.0005;
+		motor.cogging = 600;
+		plantReset(motor);
+		if (!calibrate())
+		{
+			printf("%-4s: calibration failed\n", up ? "up" : "down");
+			failures++;
+			continue;
+		}
+
+		unsigned int start = gTickCount;
+		bool ok = identifyCogging();
+		unsigned int ticks = gTickCount - start;
+		double error = tableError();
+		bool pass = ok && ticks < budget && error <= maxTableError;
+
+		printf("%-4s: cogging %.0f, table rms error %.0f, %u ticks %s\n", up ? "up" : "down", motor.cogging, error, ticks, pass ? "" : "FAIL");
+		if (!pass) failures++;
+	}
+
+	// held by more drag than the identification may command: never settles
+
+	Plant stuck;
+	stuck.eccentricity = 0.002;
+	stuck.friction = 0.0005;
+	plantReset(stuck);
+	calibrate();
+	plant.drag = sin_range;
+	plant.cogging = 600;
+
+	int writes = flashWrites;
+	unsigned int start = gTickCount;
+	bool ok = identifyCogging();
+	unsigned int ticks = gTickCount - start;
+	bool pass = !ok && ticks < budget + 1000 && flashWrites == writes && !coggingActive && config->calib.cogCompensation != 1 &&
+		usartTorqueCommandValue == 0;
+
+	printf("stuck: %s after %u ticks, %d flash writes %s\n", ok ? "accepted" : "refused", ticks, flashWrites - writes, pass ? "" : "FAIL");
+	if (!pass) failures++;
+
+	if (failures)
+	{
+		printf("FAILED: %d cases\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,139 @@
+// setPwm() against the duty computation it replaced, a * power / sin_range / timer_scale
+// with % wrapping, for every angle at a spread of powers: the duty may differ by one
+// timer count. Also counts the divisions each path makes per call, each one is an
+// __aeabi_idiv call on the Cortex-M0, and the host time per call. The min-max mode is
+// swept over every angle at full power: duties have to stay within 0..ARR, and the
+// fundamental has to grow by minMaxGain over the sine mode. "make" also checks that
+// setPwm() has no division instruction in either mode.
+
+#include <main.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <chrono>
+
+const int timer_scale = 7;
+const int sin_zero = sin_range / 2;
+const int phase2 = sin_period / 3;
+const int phase3 = sin_period * 2 / 3;
+const int timerTop = sin_range / timer_scale;			// TIM1->ARR as initPwm() sets it
+const int minMaxGain = 4729;
+
+int divisions = 0;
+
+static inline int divide(int a, int b) {
+	divisions++;
+	return a / b;
+}
+static inline int modulo(int a, int b) {
+	divisions++;
+	return a % b;
+}
+
+static void oldDuty(int angle, int power, int* duty) {
+	int a[3] = { modulo(angle, sin_period), modulo(angle + phase2, sin_period), modulo(angle + phase3, sin_period) };
+	
+	for (int i = 0; i < 3; i++)
+	{
+		if (a[i] < 0) a[i] += sin_period;
+		duty[i] = divide(divide((isin_table(a[i]) + sin_zero) * power, sin_range), timer_scale);
+	}
+}
+
+template <class F> static double nanoseconds(F f) {
+	const int rounds = 100;
+	
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds; r++)
+		for (int x = 0; x < sin_period; x++)
+			f(x * 7 - sin_period);
+	auto stop = std::chrono::steady_clock::now();
+	
+	return std::chrono::duration<double, std::nano>(stop - start).count() / rounds / sin_period;
+}
+
+int main() {
+	const int powers[] = { 0, 1, 100, 1000, 4095, 4096, 6000, 8191, sin_range };
+	int worst = 0;
+	
+	setPwmMode(pwmModeSine);
+	
+	for (int power : powers)
+	{
+		for (int angle = -sin_period; angle < 2 * sin_period; angle++)
+		{
+			int duty[3];
+			oldDuty(angle, power, duty);
+			setPwm(angle, power);
+			
+			int d1 = abs((int)TIM1->CCR1 - duty[0]);
+			int d2 = abs((int)TIM1->CCR2 - duty[1]);
+			int d3 = abs((int)TIM1->CCR3 - duty[2]);
+			if (d1 > worst) worst = d1;
+			if (d2 > worst) worst = d2;
+			if (d3 > worst) worst = d3;
+		}
+	}
+	
+	int duty[3];
+	divisions = 0;
+	oldDuty(1234, 3000, duty);
+	int oldDivisions = divisions;
+	
+	double oldTime = nanoseconds([&](int a) { oldDuty(a, 3000, duty); TIM1->CCR1 = duty[0]; });
+	double newTime = nanoseconds([](int a) { setPwm(a, 3000 + (a & 255)); });	// feed-forward moves power every period
+	
+	printf("worst duty difference %d counts\n", worst);
+	printf("old path %d divisions per call, %5.2f ns\n", oldDivisions, oldTime);
+	printf("setPwm   %5.2f ns per call at a changing power\n", newTime);
+	
+	// min-max injection at full power: in range, and the fundamental of a phase against sine mode
+	
+	int low = timerTop, high = 0;
+	double fundamental[2] = { 0, 0 };
+	for (int mode = pwmModeSine; mode <= pwmModeMinMax; mode++)
+	{
+		setPwmMode(mode);
+		double c = 0, s = 0;
+		for (int angle = 0; angle < sin_period; angle++)
+		{
+			setPwm(angle, sin_range);
+			int d[3] = { (int)TIM1->CCR1, (int)TIM1->CCR2, (int)TIM1->CCR3 };
+			for (int i = 0; i < 3; i++)
+			{
+				if (d[i] < low) low = d[i];
+				if (d[i] > high) high = d[i];
+			}
+			
+			double x = 2 * M_PI * angle / sin_period;
+			c += d[0] * cos(x);
+			s += d[0] * sin(x);
+		}
+		fundamental[mode == pwmModeMinMax] = 2 * sqrt(c * c + s * s) / sin_period;
+	}
+	double gain = fundamental[1] / fundamental[0];
+	
+	double minMaxTime = nanoseconds([](int a) { setPwm(a, 3000 + (a & 255)); });
+	setPwmMode(pwmModeSine);
+	
+	printf("min-max  duty %d..%d of 0..%d, fundamental gain %.4f (minMaxGain %.4f), %5.2f ns\n",
+		low, high, timerTop, gain, minMaxGain / 4096.0, minMaxTime);
+	
+	int failures = 0;
+	if (worst > 1)
+	{
+		printf("FAIL: duty differs by more than one count\n");
+		failures++;
+	}
+	if (low < 0 || high > timerTop)
+	{
+		printf("FAIL: duty outside 0..ARR\n");
+		failures++;
+	}
+	if (fabs(gain - minMaxGain / 4096.0) > 0.002)
+	{
+		printf("FAIL: min-max fundamental gain off\n");
+		failures++;
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,79 @@
+// What the eccentricity harmonics fitted by calibrate() buy, on motor models with a 1% and
+// 0.4% eccentric sensor. The mechanical angle, what spiTurns and the observer see, has to
+// come down to the sensor noise. Commutation is compared with the same sweeps stored the
+// way they were before the fit, a table indexed by the raw sensor angle, which calibrate()
+// leaves in calibStaging: the fit must not make it worse, and does not make it better
+// either, the 256 entry table already follows the eccentricity.
+
+#include "plant.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+extern CalibrationData calibStaging;
+
+const int maxMechanicalError = 16;			// sensor counts, the noise is +-2
+const int maxElectricLoss = 8;				// electric counts the fit may add to the raw table's error
+
+static int rawTableLookup(const int16_t* table, int angle) {
+	const int binWidth = sin_period / calibTableSize;
+
+	int i = angle / binWidth;
+	int e0 = table[i];
+	int range = ((table[(i + 1) % calibTableSize] - e0) << 17) >> 17;
+
+	return e0 + (angle - i * binWidth) * range / binWidth;
+}
+
+int main() {
+	const int poles[] = { 7, 11, 14 };
+	int failures = 0;
+
+	for (int p : poles)
+	{
+		for (int up = 0; up < 2; up++)
+		{
+			Plant motor;
+			motor.polePairs = p;
+			motor.up = up;
+			plantReset(motor);
+			if (!calibrate())
+			{
+				printf("%2d pole pairs %-4s: calibration failed\n", p, up ? "up" : "down");
+				failures++;
+				continue;
+			}
+
+			int rawMechanical = 0, mechanical = 0, rawElectric = 0, electric = 0;
+			for (int k = 0; k < 20000; k++)
+			{
+				double r = k / 20000.0;
+				int s = (int)floor(plantSensor(r) * sin_period) & sin_mask;
+				int truth = (int)lround((up ? r : -r) * sin_period);
+				int e = (int)lround(r * p * sin_period);
+
+				int d = ((s - truth) << 17) >> 17;
+				if (abs(d) > rawMechanical) rawMechanical = abs(d);
+				d = ((correctSensor(s) - truth) << 17) >> 17;
+				if (abs(d) > mechanical) mechanical = abs(d);
+
+				d = ((rawTableLookup(calibStaging.table, s) - e) << 17) >> 17;
+				if (abs(d) > rawElectric) rawElectric = abs(d);
+				d = ((getElectricDegrees(correctSensor(s)) - e) << 17) >> 17;
+				if (abs(d) > electric) electric = abs(d);
+			}
+
+			bool pass = mechanical <= maxMechanicalError && electric <= rawElectric + maxElectricLoss;
+			printf("%2d pole pairs %-4s: mechanical error %3d -> %2d counts, electric error %3d -> %3d counts %s\n",
+				p, up ? "up" : "down", rawMechanical, mechanical, rawElectric, electric, pass ? "" : "FAIL");
+			if (!pass) failures++;
+		}
+	}
+
+	if (failures)
+	{
+		printf("FAILED: %d cases\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,51 @@
+// calibrate() on motor models with different pole pair counts, both sensor directions:
+// it has to find the pole pairs and leave the map within a few electric degrees. A motor
+// beyond maxPoles has to be refused with the previous calibration kept. Every run has to
+// end well inside calibBudget, a run that only just fits would time out on a slower motor.
+
+#include "plant.h"
+#include <stdio.h>
+
+const int maxMapError = 400;				// electric counts, 4.4 degrees
+const unsigned int budget = 60000;			// calibBudget
+
+int main() {
+	const int poles[] = { 1, 7, 11, 14, 32 };
+	int failures = 0;
+	
+	for (int p : poles)
+	{
+		for (int up = 0; up < 2; up++)
+		{
+			Plant motor;
+			motor.polePairs = p;
+			motor.up = up;
+			plantReset(motor);
+			
+			unsigned int start = gTickCount;
+			bool ok = calibrate();
+			unsigned int ticks = gTickCount - start;
+			int error = ok ? plantMaxError() : -1;
+			bool pass = ok && config->calib.polePairs == p && config->calib.up == (bool)up && error <= maxMapError &&
+				ticks < budget / 2 && calibReport.duration == ticks;
+			
+			printf("%2d pole pairs %-4s: found %2d, map error %4d counts, %5u ticks %s\n",
+				p, up ? "up" : "down", config->calib.polePairs, error, ticks, pass ? "" : "FAIL");
+			if (!pass) failures++;
+		}
+	}
+	
+	Plant motor;
+	motor.polePairs = 40;
+	plantReset(motor);
+	bool refused = !calibrate() && !config->calib.calibrated && flashWrites == 0 && calibReport.status == calibStatusBadPoles;
+	printf("40 pole pairs     : %s\n", refused ? "refused" : "FAIL");
+	if (!refused) failures++;
+	
+	if (failures)
+	{
+		printf("FAIL\n");
+		return 1;
+	}
+	return 0;
+}
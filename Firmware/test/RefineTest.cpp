@@ -0,0 +1,79 @@
+// Background refinement (CALIB_REFINE) on a motor whose magnet shifted after calibrate():
+// calibRefineSample() sees the corrected angle of a rotor turning at a steady speed, the
+// main loop runs calibRefine(). The harmonics have to converge on the new eccentricity,
+// and over the simulated hour the config page may be written no more than the rate
+// limit allows, and never again once the fit is down to the sensor noise.
+
+#include "plant.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+const int periodsPerRevolution = 2000;		// 10 revolutions per second at 20 kHz
+const int periodsPerTick = 20;
+const int convergedError = 12;				// sensor counts, the noise is +-2
+
+static int sensorError() {
+	int worst = 0;
+	for (int k = 0; k < 1024; k++)
+	{
+		double rotor = k / 1024.0;
+		int s = (int)floor(plantSensor(rotor) * sin_period) & sin_mask;
+		int e = ((correctSensor(s) - (int)lround(rotor * sin_period)) << 17) >> 17;
+		if (abs(e) > worst) worst = abs(e);
+	}
+	return worst;
+}
+
+int main() {
+	Plant motor;
+	motor.eccentricity = 0.004;
+	plantReset(motor);
+	if (!calibrate())
+	{
+		printf("FAIL: calibration\n");
+		return 1;
+	}
+
+	plant.eccentricity = 0.006;				// magnet moved since
+	int before = sensorError();
+	int writes = flashWrites;
+
+	double rotor = 0;
+	int minute = 0, worstLate = 0, converged = -1;
+	for (long n = 1; n <= 60L * 60 * 20000; n++)
+	{
+		rotor += 1.0 / periodsPerRevolution;
+		controlCycles++;
+		if (n % periodsPerTick == 0) gTickCount++;
+
+		int noise = rand() % (2 * plant.noise + 1) - plant.noise;
+		calibRefineSample(correctSensor(((int)floor(plantSensor(rotor) * sin_period) + noise) & sin_mask));
+		if (n % 10 == 0) calibRefine();
+
+		if (n % (60 * 20000) == 0)
+		{
+			minute++;
+			int error = sensorError();
+			if (converged < 0 && error <= convergedError) converged = minute;
+			if (minute > 15 && error > worstLate) worstLate = error;
+		}
+	}
+
+	int saves = flashWrites - writes;
+	printf("sensor error %d counts before, %d at most after 15 minutes, converged after %d minutes, %d saves in an hour\n",
+		before, worstLate, converged, saves);
+
+	int failures = 0;
+	if (converged < 0 || converged > 5 || worstLate > convergedError)
+	{
+		printf("FAIL: harmonics did not converge\n");
+		failures++;
+	}
+	if (saves < 1 || saves > 2)
+	{
+		printf("FAIL: expected one save past the interval, no more for noise\n");
+		failures++;
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,82 @@
+// rezero() on motor models whose sensor zero moved after calibrate(), both sensor
+// directions: the table has to move by the injected offset, the map come back to
+// calibrate() accuracy and the run take under a second. A sensor that changed more than
+// its zero has to be refused with the config page untouched.
+
+#include "plant.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+const int maxMapError = 400;				// electric counts, as PoleTest
+const int maxShiftError = 200;				// electric counts between the table shift and the injected one
+const unsigned int maxTicks = 1000;
+
+int main() {
+	const int poles[] = { 7, 11, 14 };
+	const double offsets[] = { 0.0123, -0.03, 0.5 / 7 };	// revolutions, the last half an electric turn at 7
+	int failures = 0;
+
+	for (int p : poles)
+	{
+		for (int up = 0; up < 2; up++)
+		{
+			for (double offset : offsets)
+			{
+				Plant motor;
+				motor.polePairs = p;
+				motor.up = up;
+				plantReset(motor);
+				calibrate();
+
+				int16_t before[calibTableSize];
+				memcpy(before, config->calib.table, sizeof(before));
+
+				plant.offset = offset;
+				unsigned int start = gTickCount;
+				bool ok = rezero();
+				unsigned int ticks = gTickCount - start;
+				int error = plantMaxError();
+
+				// the same rotor reads offset further along, whichever way the sensor counts it
+				// the table slope turns that back into an electric shift of -offset turns
+				int expected = (int)lround(-offset * p * sin_period);
+				long sum = 0;
+				for (int k = 0; k < calibTableSize; k++)
+					sum += ((config->calib.table[k] - before[k]) << 17) >> 17;
+				int shift = ((int)(sum / calibTableSize) - expected) << 17 >> 17;
+
+				bool pass = ok && error <= maxMapError && abs(shift) <= maxShiftError && ticks < maxTicks;
+				printf("%2d pole pairs %-4s offset %7.4f: map error %4d counts, shift off by %4d, %4u ticks %s\n",
+					p, up ? "up" : "down", offset, error, shift, ticks, pass ? "" : "FAIL");
+				if (!pass) failures++;
+			}
+		}
+	}
+
+	// the magnet moved off center as well: the differences disagree
+
+	Plant motor;
+	motor.eccentricity = 0.002;
+	plantReset(motor);
+	calibrate();
+
+	ConfigData before;
+	memcpy(&before, config, sizeof(ConfigData));
+	int writes = flashWrites;
+
+	plant.offset = 0.0012;
+	plant.eccentricity = 0.05;
+	bool ok = rezero();
+	bool pass = !ok && flashWrites == writes && memcmp(&before, config, sizeof(ConfigData)) == 0;
+
+	printf("eccentric remount: %s, %d flash writes %s\n", ok ? "accepted" : "refused", flashWrites - writes, pass ? "" : "FAIL");
+	if (!pass) failures++;
+
+	if (failures)
+	{
+		printf("FAILED: %d cases\n", failures);
+		return 1;
+	}
+	return 0;
+}
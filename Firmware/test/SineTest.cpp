@@ -0,0 +1,56 @@
+// isin_S3() and isin_table() against std::sin over the whole sin_period: accuracy in Q12
+// counts and host time per call. Fails when the table is off by more than 2 counts.
+
+#include <main.h>
+#include <math.h>
+#include <stdio.h>
+#include <chrono>
+
+int isin_S3(int x);
+
+struct SineError
+{
+	double max;
+	double rms;
+};
+
+static SineError measure(int (*f)(int)) {
+	SineError e = { 0, 0 };
+	
+	for (int x = 0; x < sin_period; x++)
+	{
+		double d = f(x) - sin(2 * M_PI * x / sin_period) * (1 << 12);
+		if (fabs(d) > e.max) e.max = fabs(d);
+		e.rms += d * d;
+	}
+	e.rms = sqrt(e.rms / sin_period);
+	return e;
+}
+
+static double nanoseconds(int (*f)(int)) {
+	const int rounds = 200;
+	volatile int sink = 0;
+	
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds; r++)
+		for (int x = 0; x < sin_period; x++)
+			sink += f(x);
+	auto stop = std::chrono::steady_clock::now();
+	
+	return std::chrono::duration<double, std::nano>(stop - start).count() / rounds / sin_period;
+}
+
+int main() {
+	SineError s3 = measure(isin_S3);
+	SineError table = measure(isin_table);
+	
+	printf("isin_S3     max %6.2f rms %6.2f counts, %5.2f ns\n", s3.max, s3.rms, nanoseconds(isin_S3));
+	printf("isin_table  max %6.2f rms %6.2f counts, %5.2f ns\n", table.max, table.rms, nanoseconds(isin_table));
+	
+	if (table.max > 2)
+	{
+		printf("FAIL: table error above 2 counts\n");
+		return 1;
+	}
+	return 0;
+}
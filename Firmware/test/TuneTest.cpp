@@ -0,0 +1,81 @@
+// tuneSensor() on motor models whose MA700 second harmonic depends on the BCT setting,
+// both sensor directions: the coarse to fine sweep has to land on the known best BCT and
+// axis, the rotor has to end where it started and the map come back to calibrate()
+// accuracy. Every candidate is an NVM write in the part, so the writes per run are
+// counted, and once the unit used up tuneMaxRuns the tune has to be refused untouched.
+
+#include "plant.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+const int maxRuns = 16;						// tuneMaxRuns
+const int maxNvmWrites = 20;				// per run, the full 16 x 2 grid took about 34
+const int maxMapError = 400;				// electric counts, as PoleTest
+const double maxDrift = 0.25;				// electric revolutions between start and end, a lost lap is a whole one
+
+int main() {
+	const int poles[] = { 7, 11 };
+	const int bests[][2] = { { 80, spiAxisX }, { 176, spiAxisY } };
+	int failures = 0;
+
+	for (int p : poles)
+	{
+		for (int up = 0; up < 2; up++)
+		{
+			for (const int* best : bests)
+			{
+				Plant motor;
+				motor.polePairs = p;
+				motor.up = up;
+				motor.eccentricity = 0.002;
+				motor.ellipse = 0.04;
+				motor.bestBct = best[0];
+				motor.bestAxis = best[1];
+				plantReset(motor);
+				calibrate();
+
+				double start = plant.rotor;
+				unsigned int ticks = gTickCount;
+				bool ok = tuneSensor();
+				ticks = gTickCount - ticks;
+				int error = plantMaxError();
+				double drift = (plant.rotor - start) * p;
+
+				bool pass = ok && config->spiBct == best[0] && config->spiAxis == best[1] && config->tuneRuns == 1 &&
+					nvmWrites <= maxNvmWrites && fabs(drift) < maxDrift && error <= maxMapError;
+				printf("%2d pole pairs %-4s best %3d %c: picked %3d %c, %2d NVM writes, drift %6.3f, map error %3d, %5u ticks %s\n",
+					p, up ? "up" : "down", best[0], best[1] == spiAxisX ? 'X' : 'Y', config->spiBct,
+					config->spiAxis == spiAxisX ? 'X' : 'Y', nvmWrites, drift, error, ticks, pass ? "" : "FAIL");
+				if (!pass) failures++;
+			}
+		}
+	}
+
+	// a unit tuned maxRuns times already
+
+	Plant motor;
+	motor.ellipse = 0.04;
+	plantReset(motor);
+	calibrate();
+
+	ConfigData lc;
+	memcpy(&lc, config, sizeof(ConfigData));
+	lc.tuneRuns = maxRuns;
+	writeFlash((uint16_t*)&lc, sizeof(ConfigData) / sizeof(uint16_t));
+
+	int writes = flashWrites;
+	bool ok = tuneSensor();
+	bool pass = !ok && nvmWrites == 0 && flashWrites == writes;
+
+	printf("after %d runs: %s, %d NVM writes, %d flash writes %s\n", maxRuns, ok ? "accepted" : "refused",
+		nvmWrites, flashWrites - writes, pass ? "" : "FAIL");
+	if (!pass) failures++;
+
+	if (failures)
+	{
+		printf("FAILED: %d cases\n", failures);
+		return 1;
+	}
+	return 0;
+}
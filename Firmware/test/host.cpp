@@ -0,0 +1,19 @@
+// Peripheral registers and the firmware globals PWM.cpp needs when it runs on the host.
+
+#include <main.h>
+
+TIM_TypeDef hostTIM1;
+GPIO_TypeDef hostGPIOA, hostGPIOB, hostGPIOF;
+
+static ConfigData hostConfig;
+ConfigData* config = &hostConfig;
+
+volatile int spiCurrentAngle = 0;
+volatile int observerVelocity = 0;
+volatile int usartTorqueCommandValue = 0;
+bool coggingActive = false;
+
+int getElectricDegrees(int angle) { return angle & sin_mask; }
+int cogFeedForward(int electricAngle) { return 0; }
+void spiStartDma() {}
+void spiStopDma() {}
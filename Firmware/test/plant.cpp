@@ -0,0 +1,135 @@
+#include "plant.h"
+#include <math.h>
+#include <stdlib.h>
+
+Plant plant;
+int flashWrites = 0;
+int nvmWrites = 0;
+
+static ConfigData flashPage;
+static int sensorBct = 160, sensorAxis = spiAxisY;	// initSpi() defaults
+static double field = 0.3;			// where the field holds the rotor, mechanical revolutions
+static double velocity = 0;			// revolutions / s, only while the loop runs
+static bool loopRunning = false;
+
+unsigned int gTickCount = 0;
+volatile int spiCurrentAngle = 0;
+volatile int observerVelocity = 0;
+volatile int usartTorqueCommandValue = 0;
+volatile unsigned int controlCycles = 0;
+
+void plantReset(const Plant& p) {
+	plant = p;
+	field = p.rotor;
+	config = &flashPage;
+	flashPage = ConfigData();
+	flashWrites = 0;
+	nvmWrites = 0;
+	sensorBct = 160;
+	sensorAxis = spiAxisY;
+	velocity = 0;
+	loopRunning = false;
+	srand(1);
+	initCalibration();
+}
+
+double plantSensor(double rotor) {
+	double m = rotor + plant.offset;
+	double c = (sensorAxis == spiAxisX ? 1 : -1) * sensorBct / 256.0;	// X and Y boost pull opposite ways
+	double best = (plant.bestAxis == spiAxisX ? 1 : -1) * plant.bestBct / 256.0;
+	double h2 = 0.4 * plant.eccentricity + plant.ellipse * fabs(c - best);
+	double s = m + plant.eccentricity * sin(2 * M_PI * m + 0.5) + h2 * sin(4 * M_PI * m + 1);
+	return plant.up ? s : -s;
+}
+
+double plantCogging(double rotor) {
+	return plant.cogging * sin(2 * M_PI * plant.cogCycles * rotor);
+}
+
+int plantMaxError() {
+	int worst = 0;
+	for (int k = 0; k < 20000; k++)
+	{
+		double r = k / 20000.0;
+		int s = (int)floor(plantSensor(r) * sin_period) & sin_mask;
+		int e = getElectricDegrees(correctSensor(s));
+		int d = ((e - (int)lround(r * plant.polePairs * sin_period)) << 17) >> 17;
+		if (abs(d) > worst) worst = abs(d);
+	}
+	return worst;
+}
+
+// firmware side
+
+int spiReadAngle() {
+	int noise = rand() % (2 * plant.noise + 1) - plant.noise;
+	return ((int)floor(plantSensor(plant.rotor) * sin_period) + noise) & sin_mask;
+}
+void setPwm(int angle, int power) {
+	field = (double)angle / sin_period / plant.polePairs;
+}
+static void loopPeriod() {
+	const double dt = 1.0 / 20000;
+	
+	double drive = usartTorqueCommandValue - plantCogging(plant.rotor);	// the field leads the rotor forward, whichever way the sensor counts
+	if (velocity != 0 || fabs(drive) > plant.drag)				// else stuck
+	{
+		double drag = velocity > 0 ? plant.drag : (velocity < 0 ? -plant.drag : (drive > 0 ? plant.drag : -plant.drag));
+		double v = velocity + (drive - drag) * plant.acceleration * dt;
+		if (velocity != 0 && (v > 0) != (velocity > 0)) v = 0;	// drag stops, never reverses
+		velocity = v;
+		plant.rotor += velocity * dt;
+	}
+	
+	spiCurrentAngle = correctSensor(spiReadAngle());
+	observerVelocity = (int)(velocity * (plant.up ? 1 : -1) / 20000 * 4294967296.0);	// 2^32 per revolution per period
+}
+
+void delay(int ms) {
+	for (int i = 0; i < ms; i++)
+	{
+		gTickCount++;
+		
+		if (loopRunning)
+		{
+			for (int n = 0; n < 20; n++) loopPeriod();
+			continue;
+		}
+		
+		double rest = plant.rotor;
+		if (rest < field - plant.friction) rest = field - plant.friction;
+		if (rest > field + plant.friction) rest = field + plant.friction;
+		plant.rotor += (rest - plant.rotor) * 0.6;
+	}
+}
+int isin_table(int x) {
+	return (int)lround(sin(2 * M_PI * (x & sin_mask) / sin_period) * (1 << 12));
+}
+
+void stopControlLoop() { loopRunning = false; velocity = 0; }
+void startControlLoop() { loopRunning = true; }
+void spiSetCorrection(int bct, int axis) {
+	if (bct != sensorBct) nvmWrites++;
+	if (axis != sensorAxis) nvmWrites++;
+	sensorBct = bct;
+	sensorAxis = axis;
+}
+
+void writeFlash(uint16_t* data, int count) {
+	memcpy(&flashPage, data, count * 2);
+	flashWrites++;
+}
+void memcpy(void* dst, const void* src, int count) {
+	for (int i = 0; i < count; i++)
+		((char*)dst)[i] = ((const char*)src)[i];
+}
+uint16_t crc16(const void* data, int count, uint16_t crc) {
+	const uint8_t* p = (const uint8_t*)data;
+	for (int i = 0; i < count; i++)
+	{
+		crc ^= p[i] << 8;
+		for (int b = 0; b < 8; b++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
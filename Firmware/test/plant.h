@@ -0,0 +1,39 @@
+// Motor and sensor model Calibrate.cpp runs against on the host: setPwm() pulls the rotor
+// toward the field through a friction band, spiReadAngle() reads an eccentric sensor.
+// Between startControlLoop() and stopControlLoop() the loop commutates perfectly instead:
+// the torque command accelerates the rotor against cogging and drag, and spiCurrentAngle
+// and observerVelocity follow it. spiSetCorrection() changes the sensor's second harmonic.
+
+#ifndef PLANT_H
+#define PLANT_H
+
+#include <main.h>
+
+struct Plant
+{
+	int polePairs = 7;
+	bool up = true;					// sensor counts up as the field advances
+	double rotor = 0.3;				// mechanical revolutions
+	double offset = 0;				// sensor zero, revolutions
+	double eccentricity = 0.01;		// first harmonic sensor error, revolutions
+	double friction = 0.002;		// the rotor stops this far behind the field, revolutions
+	int noise = 2;					// sensor counts, +-
+	double cogging = 0;				// torque command units, amplitude
+	int cogCycles = 84;				// per revolution, LCM(12 slots, 14 poles)
+	double drag = 100;				// Coulomb friction, torque command units
+	double acceleration = 0.0225;	// revolutions / s^2 per torque command unit
+	double ellipse = 0;				// second harmonic sensor error per unit of BCT off the best, revolutions
+	int bestBct = 80;				// MA700 correction that cancels the ellipse
+	int bestAxis = spiAxisX;
+};
+
+extern Plant plant;
+extern int flashWrites;
+extern int nvmWrites;				// MA700 register writes, unchanged values skipped as spiWriteRegister() does
+
+void plantReset(const Plant& p);	// new motor, RAM config page, erased calibration
+double plantSensor(double rotor);	// sensor reading in revolutions, without noise
+double plantCogging(double rotor);	// torque command holding the rotor against cogging
+int plantMaxError();				// worst electric counts between the map and the true field angle
+
+#endif
@@ -0,0 +1,69 @@
+// Host stand-in for the STM32F0 HAL header: peripherals are plain structs in RAM so the
+// firmware sources under test compile and run with g++. Only what those sources use.
+
+#ifndef STM32F0XX_HAL_H
+#define STM32F0XX_HAL_H
+
+#include <stdint.h>
+
+typedef unsigned int uint;
+
+typedef struct { volatile uint32_t CR1, CR2, SMCR, DIER, SR, EGR, CCMR1, CCMR2, CCER, CNT, PSC, ARR, RCR, CCR1, CCR2, CCR3, CCR4, BDTR, DCR, DMAR, OR; } TIM_TypeDef;
+typedef struct { volatile uint32_t MODER, OTYPER, OSPEEDR, PUPDR, IDR, ODR, BSRR, LCKR, AFR[2], BRR; } GPIO_TypeDef;
+
+extern TIM_TypeDef hostTIM1;
+extern GPIO_TypeDef hostGPIOA, hostGPIOB, hostGPIOF;
+
+#define TIM1						(&hostTIM1)
+#define GPIOA						(&hostGPIOA)
+#define GPIOB						(&hostGPIOB)
+#define GPIOF						(&hostGPIOF)
+
+#define TIM_CR1_CEN					(1u << 0)
+#define TIM_CR1_DIR					(1u << 4)
+#define TIM_CR1_CMS_Pos				5
+#define TIM_AUTORELOAD_PRELOAD_ENABLE	(1u << 7)
+#define TIM_SR_UIF					(1u << 0)
+#define TIM_CCMR1_OC1PE				(1u << 3)
+#define TIM_CCMR1_OC1M_Pos			4
+#define TIM_CCMR1_OC2PE				(1u << 11)
+#define TIM_CCMR1_OC2M_Pos			12
+#define TIM_CCMR2_OC3PE				(1u << 3)
+#define TIM_CCMR2_OC3M_Pos			4
+#define TIM_CCER_CC1E				(1u << 0)
+#define TIM_CCER_CC1NE				(1u << 2)
+#define TIM_CCER_CC2E				(1u << 4)
+#define TIM_CCER_CC2NE				(1u << 6)
+#define TIM_CCER_CC3E				(1u << 8)
+#define TIM_CCER_CC3NE				(1u << 10)
+#define TIM_BDTR_OSSI				(1u << 10)
+#define TIM_BDTR_OSSR				(1u << 11)
+#define TIM_BDTR_MOE				(1u << 15)
+
+#define GPIO_MODER_MODER6_Pos		12
+#define GPIO_MODER_MODER7_Pos		14
+#define GPIO_MODER_MODER8_Pos		16
+#define GPIO_MODER_MODER9_Pos		18
+#define GPIO_MODER_MODER10_Pos		20
+#define GPIO_MODER_MODER11_Pos		22
+#define GPIO_MODER_MODER13_Pos		26
+#define GPIO_MODER_MODER14_Pos		28
+#define GPIO_MODER_MODER15_Pos		30
+#define GPIO_OSPEEDR_OSPEEDR8		(3u << 16)
+#define GPIO_OSPEEDR_OSPEEDR9		(3u << 18)
+#define GPIO_OSPEEDR_OSPEEDR10		(3u << 20)
+#define GPIO_OSPEEDR_OSPEEDR11_Pos	22
+#define GPIO_OSPEEDR_OSPEEDR13		(3u << 26)
+#define GPIO_OSPEEDR_OSPEEDR14		(3u << 28)
+#define GPIO_OSPEEDR_OSPEEDR15		(3u << 30)
+#define GPIO_PUPDR_PUPDR6_Pos		12
+#define GPIO_PUPDR_PUPDR7_Pos		14
+#define GPIO_PUPDR_PUPDR11_Pos		22
+#define GPIO_AFRH_AFSEL8_Pos		0
+#define GPIO_AFRH_AFSEL9_Pos		4
+#define GPIO_AFRH_AFSEL10_Pos		8
+#define GPIO_AFRH_AFSEL13_Pos		20
+#define GPIO_AFRH_AFSEL14_Pos		24
+#define GPIO_AFRH_AFSEL15_Pos		28
+
+#endif